@@ -4,6 +4,7 @@
 #include <Eina.h>
 
 extern int SHOTGUN_EVENT_CONNECT; /* Shotgun_Auth */
+extern int SHOTGUN_EVENT_RECONNECT; /* Shotgun_Auth: the connection dropped, a new one is on its way */
 extern int SHOTGUN_EVENT_IQ; /* Shotgun_Event_Iq */
 extern int SHOTGUN_EVENT_MESSAGE; /* Shotgun_Event_Message */
 extern int SHOTGUN_EVENT_PRESENCE; /* Shotgun_Event_Presence */
@@ -22,7 +23,8 @@ typedef enum
    SHOTGUN_USER_SUBSCRIPTION_NONE,
    SHOTGUN_USER_SUBSCRIPTION_FROM,
    SHOTGUN_USER_SUBSCRIPTION_TO,
-   SHOTGUN_USER_SUBSCRIPTION_BOTH
+   SHOTGUN_USER_SUBSCRIPTION_BOTH,
+   SHOTGUN_USER_SUBSCRIPTION_REMOVE /* only in roster events: the user is no longer in the roster */
 } Shotgun_User_Subscription;
 
 typedef enum
@@ -60,8 +62,11 @@ typedef struct
    struct
      {
         const char *type;
-        void *data;
+        void *data; /* use shotgun_user_info_photo_get() */
         size_t size;
+        const char *sha1; /* hex hash of data, the avatar cache key */
+        Eina_Bool mapped : 1; /* data is mapped from the avatar cache */
+        Eina_Bool encoded : 1; /* data is still the base64 BINVAL, size is its length */
      } photo;
 } Shotgun_User_Info;
 
@@ -98,6 +103,15 @@ extern "C" {
 
 int shotgun_init(void);
 Eina_Bool shotgun_gchat_connect(Shotgun_Auth *auth);
+/**
+ * Outgoing stanzas are queued and sent together at the end of the
+ * current main loop iteration. This sends anything queued immediately.
+ */
+void shotgun_flush(Shotgun_Auth *auth);
+/**
+ * Writes $XDG_CACHE_HOME/shotgun/sub into dir, creating it if needed.
+ */
+Eina_Bool shotgun_cache_dir(char *dir, size_t size, const char *sub);
 
 Shotgun_Auth *shotgun_new(const char *username, const char *domain);
 /**
@@ -105,9 +119,40 @@ Shotgun_Auth *shotgun_new(const char *username, const char *domain);
  */
 void shotgun_password_set(Shotgun_Auth *auth, const char *password);
 void shotgun_password_del(Shotgun_Auth *auth);
+/**
+ * Connects with TLS straight away on port 5223 instead of upgrading
+ * a plaintext stream, falling back to STARTTLS if that doesn't work.
+ */
+void shotgun_direct_tls_set(Shotgun_Auth *auth, Eina_Bool direct);
+/**
+ * Sends the roster request and the presence from shotgun_presence_set()
+ * right behind the bind of every new session instead of leaving them to
+ * the SHOTGUN_EVENT_CONNECT handler, saving a round trip per login.
+ */
+void shotgun_login_pipeline_set(Shotgun_Auth *auth, Eina_Bool pipeline);
+/**
+ * Returns the account's full jid, user@domain/resource.
+ */
+const char *shotgun_jid_get(Shotgun_Auth *auth);
 
 Eina_Bool shotgun_iq_roster_get(Shotgun_Auth *auth);
 Eina_Bool shotgun_iq_vcard_get(Shotgun_Auth *auth, const char *user);
+/**
+ * Limits the number of unanswered vcard requests; the rest are queued.
+ * 0 restores the default.
+ */
+void shotgun_iq_vcard_window_set(Shotgun_Auth *auth, unsigned int window);
+/**
+ * Like shotgun_iq_vcard_get(), but if the avatar with hash sha1 (from
+ * Shotgun_Event_Presence::photo) is cached, no request is sent and the
+ * SHOTGUN_EVENT_IQ carries only the jid and cached photo.
+ */
+Eina_Bool shotgun_iq_vcard_get_cached(Shotgun_Auth *auth, const char *user, const char *sha1);
+/**
+ * Returns the image data of info's photo, or NULL if it has none.
+ * vcard photos are only decoded (and cached on disk) the first time this is called.
+ */
+const void *shotgun_user_info_photo_get(Shotgun_User_Info *info, size_t *size);
 
 Eina_Bool shotgun_message_send(Shotgun_Auth *auth, const char *to, const char *msg, Shotgun_Message_Status status);
 
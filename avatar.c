@@ -0,0 +1,91 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "shotgun_private.h"
+
+/* avatars are stored as raw image data in $XDG_CACHE_HOME/shotgun/avatars/<sha1>,
+ * where sha1 is the hex hash advertised in vcard-temp:x:update presence
+ */
+
+static char avatar_dir[PATH_MAX];
+
+static const char *
+shotgun_avatar_dir(void)
+{
+   if ((!avatar_dir[0]) && (!shotgun_cache_dir(avatar_dir, sizeof(avatar_dir), "avatars")))
+     return NULL;
+   return avatar_dir;
+}
+
+/* the hash comes off the wire and ends up in a path, so be strict */
+static Eina_Bool
+shotgun_avatar_path(const char *sha1, char *path, size_t size)
+{
+   const char *dir;
+   char hash[41];
+   int i;
+
+   for (i = 0; i < 40; i++)
+     {
+        if (!isxdigit(sha1[i])) return EINA_FALSE;
+        hash[i] = tolower(sha1[i]);
+     }
+   if (sha1[40]) return EINA_FALSE;
+   hash[40] = 0;
+
+   dir = shotgun_avatar_dir();
+   if (!dir) return EINA_FALSE;
+   snprintf(path, size, "%s/%s", dir, hash);
+   return EINA_TRUE;
+}
+
+/* maps the cached avatar with hash sha1 into info->photo */
+Eina_Bool
+shotgun_avatar_load(Shotgun_User_Info *info, const char *sha1)
+{
+   char path[PATH_MAX];
+   struct stat st;
+   void *map;
+   int fd;
+
+   if (!shotgun_avatar_path(sha1, path, sizeof(path))) return EINA_FALSE;
+   fd = open(path, O_RDONLY);
+   if (fd < 0) return EINA_FALSE;
+   if (fstat(fd, &st) || (!st.st_size))
+     {
+        close(fd);
+        return EINA_FALSE;
+     }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) return EINA_FALSE;
+
+   DBG("Avatar %s found in cache", sha1);
+   info->photo.data = map;
+   info->photo.size = st.st_size;
+   info->photo.mapped = EINA_TRUE;
+   eina_stringshare_replace(&info->photo.sha1, path + strlen(path) - 40);
+   return EINA_TRUE;
+}
+
+/* hashes info's photo and writes it to the cache if it isn't there yet */
+void
+shotgun_avatar_save(Shotgun_User_Info *info)
+{
+   char path[PATH_MAX], sha1[41];
+
+   if (!info->photo.size) return;
+   shotgun_sha1_hex(info->photo.data, info->photo.size, sha1);
+   eina_stringshare_replace(&info->photo.sha1, sha1);
+   if (!shotgun_avatar_path(sha1, path, sizeof(path))) return;
+   if (!access(path, F_OK)) return;
+
+   if (!shotgun_file_write(path, info->photo.data, info->photo.size)) return;
+   DBG("Avatar %s cached", sha1);
+}
@@ -0,0 +1,327 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shotgun_private.h"
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+# include <tmmintrin.h>
+#endif
+
+/* base64, rfc4648.
+ * decoding skips whitespace since servers like to wrap BINVAL at 76 columns.
+ * runs of 16 characters without whitespace or padding are translated 16 at a
+ * time with SSE2 and packed with SSSE3 where available.
+ * encoding never wraps, and does 12 bytes at a time with SSSE3.
+ */
+
+static const char b64_enc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define B64_WS  -2
+#define B64_PAD -3
+
+static const signed char b64_dec[256] =
+{
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -2, -2, -1, -1, -2, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+   52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -3, -1, -1,
+   -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+   15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+   -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+   41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+#ifdef __SSE2__
+# define B64_RANGE(V, LO, HI) \
+  _mm_and_si128(_mm_cmpgt_epi8((V), _mm_set1_epi8((LO) - 1)), _mm_cmplt_epi8((V), _mm_set1_epi8((HI) + 1)))
+
+/* translates 16 characters to sextets, returns EINA_FALSE if any of them isn't base64 */
+static inline Eina_Bool
+b64_sse2_translate(const char *in, __m128i *out)
+{
+   __m128i v, m, sum, valid;
+
+   v = _mm_loadu_si128((const __m128i*)in);
+   m = B64_RANGE(v, 'A', 'Z');
+   valid = m;
+   sum = _mm_and_si128(m, _mm_set1_epi8(-'A'));
+   m = B64_RANGE(v, 'a', 'z');
+   valid = _mm_or_si128(valid, m);
+   sum = _mm_or_si128(sum, _mm_and_si128(m, _mm_set1_epi8(26 - 'a')));
+   m = B64_RANGE(v, '0', '9');
+   valid = _mm_or_si128(valid, m);
+   sum = _mm_or_si128(sum, _mm_and_si128(m, _mm_set1_epi8(52 - '0')));
+   m = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+   valid = _mm_or_si128(valid, m);
+   sum = _mm_or_si128(sum, _mm_and_si128(m, _mm_set1_epi8(62 - '+')));
+   m = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+   valid = _mm_or_si128(valid, m);
+   sum = _mm_or_si128(sum, _mm_and_si128(m, _mm_set1_epi8(63 - '/')));
+   if (_mm_movemask_epi8(valid) != 0xffff) return EINA_FALSE;
+   *out = _mm_add_epi8(v, sum);
+   return EINA_TRUE;
+}
+
+/* packs 16 sextets into 12 bytes with SSE2 shifts and a scalar byte swap */
+static inline void
+b64_sse2_pack(__m128i v, unsigned char *out)
+{
+   uint32_t w[4];
+   __m128i t;
+   int i;
+
+   /* ab: a << 6 | b in each 16 bit lane */
+   t = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0xff)), 6), _mm_srli_epi16(v, 8));
+   /* abcd: ab << 12 | cd in each 32 bit lane */
+   t = _mm_madd_epi16(t, _mm_set1_epi32(0x00011000));
+   _mm_storeu_si128((__m128i*)w, t);
+   for (i = 0; i < 4; i++, out += 3)
+     {
+        out[0] = w[i] >> 16;
+        out[1] = w[i] >> 8;
+        out[2] = w[i];
+     }
+}
+
+__attribute__((target("ssse3")))
+static void
+b64_ssse3_pack(__m128i v, unsigned char *out)
+{
+   __m128i t;
+   uint32_t last;
+
+   t = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+   t = _mm_madd_epi16(t, _mm_set1_epi32(0x00011000));
+   t = _mm_shuffle_epi8(t, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+   /* exactly 12 bytes, so decoding in place never overwrites unread input */
+   _mm_storel_epi64((__m128i*)out, t);
+   last = _mm_cvtsi128_si32(_mm_srli_si128(t, 8));
+   memcpy(out + 8, &last, sizeof(last));
+}
+
+/* encodes 12 of the 16 bytes at in to 16 characters */
+__attribute__((target("ssse3")))
+static void
+b64_ssse3_encode(const unsigned char *in, char *out)
+{
+   __m128i v, t;
+
+   v = _mm_loadu_si128((const __m128i*)in);
+   /* spread each 3 bytes over 4, then cut them into sextets */
+   v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+   t = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+   v = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+   v = _mm_or_si128(v, t);
+   /* sextet to ascii: 'A' + v, then correct for the other ranges */
+   t = _mm_add_epi8(v, _mm_set1_epi8('A'));
+   t = _mm_add_epi8(t, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(25)), _mm_set1_epi8('a' - 'A' - 26)));
+   t = _mm_add_epi8(t, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(51)), _mm_set1_epi8('0' - 'a' - 26)));
+   t = _mm_add_epi8(t, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(62)), _mm_set1_epi8('+' - '0' - 10)));
+   t = _mm_add_epi8(t, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(63)), _mm_set1_epi8('/' - '0' - 11)));
+   _mm_storeu_si128((__m128i*)out, t);
+}
+
+static int b64_ssse3 = -1;
+
+static inline void
+b64_cpu_init(void)
+{
+   if (b64_ssse3 >= 0) return;
+   __builtin_cpu_init();
+   b64_ssse3 = !!__builtin_cpu_supports("ssse3");
+}
+#endif
+
+/* decodes len characters from in into out, which may point to in itself.
+ * out must have room for (len + 3) / 4 * 3 bytes.
+ * returns the number of bytes written or -1 on malformed input.
+ */
+ssize_t
+shotgun_base64_decode_buf(const char *in, size_t len, unsigned char *out)
+{
+   unsigned char *o = out;
+   uint32_t acc = 0;
+   size_t i = 0;
+   int n = 0, pad = 0;
+
+#ifdef __SSE2__
+   b64_cpu_init();
+#endif
+   while (i < len)
+     {
+        signed char v;
+
+#ifdef __SSE2__
+        if ((!n) && (!pad) && (len - i >= 16))
+          {
+             __m128i s;
+
+             if (b64_sse2_translate(in + i, &s))
+               {
+                  if (b64_ssse3) b64_ssse3_pack(s, o);
+                  else b64_sse2_pack(s, o);
+                  i += 16;
+                  o += 12;
+                  continue;
+               }
+          }
+#endif
+        v = b64_dec[(unsigned char)in[i++]];
+        if (v == B64_WS) continue;
+        if (v == B64_PAD)
+          {
+             pad++;
+             continue;
+          }
+        if ((v < 0) || pad) return -1;
+        acc = (acc << 6) | v;
+        if (++n < 4) continue;
+        o[0] = acc >> 16;
+        o[1] = acc >> 8;
+        o[2] = acc;
+        o += 3;
+        n = 0;
+     }
+   switch (n)
+     {
+      case 0:
+        break;
+      case 2:
+        *o++ = acc >> 4;
+        break;
+      case 3:
+        *o++ = acc >> 10;
+        *o++ = acc >> 2;
+        break;
+      default:
+        return -1;
+     }
+   if (pad > 2) return -1;
+   return o - out;
+}
+
+unsigned char *
+shotgun_base64_decode(const char *string, size_t len, size_t *size)
+{
+   unsigned char *ret;
+   ssize_t n;
+
+   if ((!len) || (!string)) return NULL;
+
+   ret = malloc((len + 3) / 4 * 3);
+   if (!ret) return NULL;
+   n = shotgun_base64_decode_buf(string, len, ret);
+   if (n <= 0)
+     {
+        free(ret);
+        return NULL;
+     }
+   *size = n;
+   return ret;
+}
+
+/* encodes len bytes from in into out, which must have room for
+ * (len + 2) / 3 * 4 characters. returns the number of characters written.
+ */
+size_t
+shotgun_base64_encode_buf(const unsigned char *in, size_t len, char *out)
+{
+   char *o = out;
+   size_t i = 0;
+
+#ifdef __SSE2__
+   b64_cpu_init();
+   if (b64_ssse3)
+     /* 16 bytes are loaded for every 12 encoded */
+     for (; len - i >= 16; i += 12, o += 16)
+       b64_ssse3_encode(in + i, o);
+#endif
+   for (; len - i >= 3; i += 3, o += 4)
+     {
+        uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+        o[0] = b64_enc[v >> 18];
+        o[1] = b64_enc[(v >> 12) & 63];
+        o[2] = b64_enc[(v >> 6) & 63];
+        o[3] = b64_enc[v & 63];
+     }
+   if (len - i)
+     {
+        uint32_t v = in[i] << 16;
+
+        if (len - i == 2) v |= in[i + 1] << 8;
+        o[0] = b64_enc[v >> 18];
+        o[1] = b64_enc[(v >> 12) & 63];
+        o[2] = (len - i == 2) ? b64_enc[(v >> 6) & 63] : '=';
+        o[3] = '=';
+        o += 4;
+     }
+   return o - out;
+}
+
+char *
+shotgun_base64_encode(const unsigned char *string, size_t len, size_t *size)
+{
+   char *ret;
+
+   if ((!len) || (!string)) return NULL;
+
+   ret = malloc((len + 2) / 3 * 4 + 1);
+   if (!ret) return NULL;
+   *size = shotgun_base64_encode_buf(string, len, ret);
+   ret[*size] = 0;
+   return ret;
+}
+
+/* streaming encoder: data can be fed in pieces of any size and is
+ * appended to buf as it goes, through a small bounce buffer
+ */
+void
+shotgun_base64_encode_append(Shotgun_Base64 *b64, Eina_Strbuf *buf, const void *data, size_t len)
+{
+   const unsigned char *p = data;
+   char out[4096];
+   size_t n;
+
+   if (b64->n)
+     {
+        while (len && (b64->n < 3))
+          {
+             b64->in[b64->n++] = *p++;
+             len--;
+          }
+        if (b64->n < 3) return;
+        eina_strbuf_append_length(buf, out, shotgun_base64_encode_buf(b64->in, 3, out));
+        b64->n = 0;
+     }
+   while (len >= 3)
+     {
+        n = len - len % 3;
+        if (n > sizeof(out) / 4 * 3) n = sizeof(out) / 4 * 3;
+        eina_strbuf_append_length(buf, out, shotgun_base64_encode_buf(p, n, out));
+        p += n;
+        len -= n;
+     }
+   memcpy(b64->in, p, len);
+   b64->n = len;
+}
+
+/* flushes whatever is left, with padding */
+void
+shotgun_base64_encode_end(Shotgun_Base64 *b64, Eina_Strbuf *buf)
+{
+   char out[4];
+
+   if (b64->n)
+     eina_strbuf_append_length(buf, out, shotgun_base64_encode_buf(b64->in, b64->n, out));
+   b64->n = 0;
+}
@@ -0,0 +1,181 @@
+/* base64 decoder check and micro-benchmark, not part of shotgun.
+ * checks that shotgun_base64_decode_buf() round-trips every length up to
+ * 2000 (wrapped at 76 columns or not, in place, without padding) and rejects
+ * malformed input, then times it against the libb64 decoder it replaced on a
+ * 150 KB avatar-sized buffer. build and run from the top directory:
+ *
+ * gcc -O2 -D_GNU_SOURCE -I. bench/base64.c bench/cdecode.c \
+ *    $(pkg-config --cflags --libs ecore-con) -o bench/base64 && bench/base64
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "../base64.c"
+#include "cdecode.h"
+
+#define BENCH_SIZE 150000
+#define BENCH_RUNS 200
+#define CHECK_MAX 2000
+
+int shotgun_log_dom = -1;
+
+static unsigned char data[BENCH_SIZE], out[BENCH_SIZE];
+static char enc[BENCH_SIZE * 2], tmp[BENCH_SIZE * 2];
+
+/* encodes data into enc, wrapped at 76 columns like BINVAL usually is */
+static size_t
+_bench_encode(size_t len, Eina_Bool wrap)
+{
+   size_t n, i, j;
+
+   n = shotgun_base64_encode_buf(data, len, tmp);
+   if (!wrap)
+     {
+        memcpy(enc, tmp, n);
+        return n;
+     }
+   for (i = j = 0; i < n; i++)
+     {
+        if (i && (!(i % 76))) enc[j++] = '\n';
+        enc[j++] = tmp[i];
+     }
+   return j;
+}
+
+static double
+_bench_now(void)
+{
+   struct timespec t;
+
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static unsigned int
+_bench_check(void)
+{
+   unsigned int fails = 0;
+   size_t len, i, n;
+   int wrap;
+   ssize_t r;
+
+   for (len = 0; len <= CHECK_MAX; len++)
+     for (wrap = 0; wrap < 2; wrap++)
+       {
+          for (i = 0; i < len; i++)
+            data[i] = rand();
+          n = _bench_encode(len, wrap);
+
+          r = shotgun_base64_decode_buf(enc, n, out);
+          if ((r != (ssize_t)len) || memcmp(out, data, len))
+            {
+               printf("  %zu bytes%s: got %zd\n", len, wrap ? ", wrapped" : "", r);
+               fails++;
+            }
+
+          memcpy(tmp, enc, n);
+          r = shotgun_base64_decode_buf(tmp, n, (unsigned char*)tmp);
+          if ((r != (ssize_t)len) || memcmp(tmp, data, len))
+            {
+               printf("  %zu bytes%s, in place: got %zd\n", len, wrap ? ", wrapped" : "", r);
+               fails++;
+            }
+
+          if (wrap) continue;
+          while (n && (enc[n - 1] == '=')) n--;
+          r = shotgun_base64_decode_buf(enc, n, out);
+          if ((r != (ssize_t)len) || memcmp(out, data, len))
+            {
+               printf("  %zu bytes, unpadded: got %zd\n", len, r);
+               fails++;
+            }
+       }
+   return fails;
+}
+
+static unsigned int
+_bench_check_bad(void)
+{
+   static const char *bad[] = { "QUJD*EFG", "QQ==QUJD", "Q", "QUJDRA===", NULL };
+   unsigned int fails = 0, i;
+
+   for (i = 0; bad[i]; i++)
+     if (shotgun_base64_decode_buf(bad[i], strlen(bad[i]), out) != -1)
+       {
+          printf("  \"%s\" was not rejected\n", bad[i]);
+          fails++;
+       }
+   return fails;
+}
+
+static double
+_bench_libb64(size_t n)
+{
+   base64_decodestate s;
+   double t;
+   int i;
+
+   t = _bench_now();
+   for (i = 0; i < BENCH_RUNS; i++)
+     {
+        base64_init_decodestate(&s);
+        base64_decode_block(enc, n, out, &s);
+     }
+   return n * (double)BENCH_RUNS / (_bench_now() - t) / 1e6;
+}
+
+static double
+_bench_shotgun(size_t n)
+{
+   double t;
+   int i;
+
+   t = _bench_now();
+   for (i = 0; i < BENCH_RUNS; i++)
+     shotgun_base64_decode_buf(enc, n, out);
+   return n * (double)BENCH_RUNS / (_bench_now() - t) / 1e6;
+}
+
+int
+main(void)
+{
+   unsigned int fails = 0;
+   size_t i, n;
+   int wrap;
+
+   srand(1);
+#ifdef __SSE2__
+   b64_cpu_init();
+   if (b64_ssse3)
+     {
+        printf("round trips, ssse3\n");
+        fails += _bench_check();
+        b64_ssse3 = 0;
+     }
+#endif
+   printf("round trips\n");
+   fails += _bench_check();
+   printf("malformed input\n");
+   fails += _bench_check_bad();
+   printf("%u failures\n", fails);
+
+   for (i = 0; i < BENCH_SIZE; i++)
+     data[i] = rand();
+   for (wrap = 1; wrap >= 0; wrap--)
+     {
+        n = _bench_encode(BENCH_SIZE, wrap);
+        printf("%s: libb64 %.0f MB/s, shotgun %.0f MB/s", wrap ? "wrapped at 76" : "unwrapped",
+               _bench_libb64(n), _bench_shotgun(n));
+#ifdef __SSE2__
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+          {
+             b64_ssse3 = 1;
+             printf(", shotgun ssse3 %.0f MB/s", _bench_shotgun(n));
+             b64_ssse3 = 0;
+          }
+#endif
+        printf("\n");
+     }
+   return !!fails;
+}
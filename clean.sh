@@ -1,2 +1,3 @@
 rm -f *.{o,a} ui/*.{o,a}
 rm -f shotgun
+rm -f bench/base64
@@ -1,6 +1,10 @@
 #include <Ecore.h>
+#include <sys/mman.h>
 #include "shotgun_private.h"
 #include "xml.h"
+
+/* default number of unanswered vcard requests */
+#define SHOTGUN_VCARD_WINDOW 8
 /*
 errors: http://www.rfc-editor.org/rfc/rfc6120.txt
 The "stanza-kind" MUST be one of message, presence, or iq.
@@ -34,10 +38,43 @@ shotgun_user_info_free(Shotgun_User_Info *info)
    eina_stringshare_del(info->jid);
    eina_stringshare_del(info->full_name);
    eina_stringshare_del(info->photo.type);
-   free(info->photo.data);
+   eina_stringshare_del(info->photo.sha1);
+   if (info->photo.mapped)
+     munmap(info->photo.data, info->photo.size);
+   else
+     free(info->photo.data);
    free(info);
 }
 
+const void *
+shotgun_user_info_photo_get(Shotgun_User_Info *info, size_t *size)
+{
+   ssize_t len;
+
+   if (size) *size = 0;
+   EINA_SAFETY_ON_NULL_RETURN_VAL(info, NULL);
+
+   if (info->photo.encoded)
+     {  /* decoded output is never longer than its input, so reuse the buffer */
+        info->photo.encoded = EINA_FALSE;
+        len = shotgun_base64_decode_buf(info->photo.data, info->photo.size, info->photo.data);
+        if (len <= 0)
+          {
+             ERR("Could not decode photo for %s", info->jid);
+             free(info->photo.data);
+             info->photo.data = NULL;
+             info->photo.size = 0;
+             return NULL;
+          }
+        info->photo.data = realloc(info->photo.data, len);
+        info->photo.size = len;
+        shotgun_avatar_save(info);
+     }
+   if (!info->photo.data) return NULL;
+   if (size) *size = info->photo.size;
+   return info->photo.data;
+}
+
 static void
 shotgun_iq_event_free(void *data __UNUSED__, Shotgun_Event_Iq *iq)
 {
@@ -57,14 +94,195 @@ shotgun_iq_event_free(void *data __UNUSED__, Shotgun_Event_Iq *iq)
    free(iq);
 }
 
+typedef struct
+{
+   Shotgun_Auth *auth;
+   Shotgun_Iq_Cb cb;
+   void *data;
+   Ecore_Timer *timer;
+   char id[16];
+} Shotgun_Iq_Request;
+
+static const char *const shotgun_iq_errors[] =
+{
+   "none",
+   "auth",
+   "cancel",
+   "continue",
+   "modify",
+   "wait",
+   "timeout",
+   "disconnected"
+};
+
+const char *
+shotgun_iq_error_str(Shotgun_Iq_Error error)
+{
+   if ((unsigned int)error > SHOTGUN_IQ_ERROR_DISCONNECTED) return "unknown";
+   return shotgun_iq_errors[error];
+}
+
+static Eina_Bool
+shotgun_iq_request_timeout(Shotgun_Iq_Request *req)
+{
+   INF("No answer to iq %s", req->id);
+   req->timer = NULL;
+   eina_hash_del_by_key(req->auth->iqs, req->id);
+   req->cb(req->data, req->auth, NULL, SHOTGUN_IQ_ERROR_TIMEOUT);
+   free(req);
+   return EINA_FALSE;
+}
+
+/* registers cb for the answer to an iq which is about to be sent.
+ * returns the id that iq must carry.
+ */
+const char *
+shotgun_iq_request_add(Shotgun_Auth *auth, Shotgun_Iq_Cb cb, const void *data, double timeout)
+{
+   Shotgun_Iq_Request *req;
+
+   req = calloc(1, sizeof(Shotgun_Iq_Request));
+   req->auth = auth;
+   req->cb = cb;
+   req->data = (void*)data;
+   snprintf(req->id, sizeof(req->id), "%u", ++auth->iq_id);
+   if (timeout > 0)
+     req->timer = ecore_timer_add(timeout, (Ecore_Task_Cb)shotgun_iq_request_timeout, req);
+   if (!auth->iqs) auth->iqs = eina_hash_string_superfast_new(NULL);
+   eina_hash_direct_add(auth->iqs, req->id, req);
+   return req->id;
+}
+
+static Eina_Bool
+shotgun_iq_request_list_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Shotgun_Iq_Request *req, Eina_List **list)
+{
+   *list = eina_list_append(*list, req);
+   return EINA_TRUE;
+}
+
+/* fails every request, their answers won't come on a new session */
+void
+shotgun_iq_requests_cancel(Shotgun_Auth *auth)
+{
+   Shotgun_Iq_Request *req;
+   Eina_List *list = NULL;
+
+   if (!auth->iqs) return;
+   /* callbacks may well send new requests */
+   eina_hash_foreach(auth->iqs, (Eina_Hash_Foreach)shotgun_iq_request_list_cb, &list);
+   eina_hash_free_buckets(auth->iqs);
+   if (list) INF("Cancelling %u requests", eina_list_count(list));
+   EINA_LIST_FREE(list, req)
+     {
+        if (req->timer) ecore_timer_del(req->timer);
+        req->cb(req->data, auth, NULL, SHOTGUN_IQ_ERROR_DISCONNECTED);
+        free(req);
+     }
+}
+
+/* hands an answer to whoever asked for it.
+ * returns whether the event should still be emitted
+ */
+static Eina_Bool
+shotgun_iq_request_answer(Shotgun_Auth *auth, Shotgun_Iq_Reply *reply, Shotgun_Event_Iq *iq)
+{
+   Shotgun_Iq_Request *req;
+   Eina_Bool ret;
+
+   if ((!auth->iqs) || (!reply->id[0])) return EINA_TRUE;
+   req = eina_hash_find(auth->iqs, reply->id);
+   if (!req) return EINA_TRUE;
+
+   eina_hash_del_by_key(auth->iqs, reply->id);
+   if (req->timer) ecore_timer_del(req->timer);
+   ret = req->cb(req->data, auth, iq, reply->error);
+   free(req);
+   return ret;
+}
+
+static Eina_Bool
+shotgun_iq_vcard_cb(const char *jid, Shotgun_Auth *auth, Shotgun_Event_Iq *iq, Shotgun_Iq_Error error)
+{
+   auth->vcard.pending--;
+   if (error == SHOTGUN_IQ_ERROR_DISCONNECTED)
+     {  /* ask again on the next session */
+        auth->vcard.queue = eina_list_prepend(auth->vcard.queue, jid);
+        return EINA_FALSE;
+     }
+   eina_hash_del_by_key(auth->vcard.jids, jid);
+   if (iq && (iq->type == SHOTGUN_IQ_EVENT_TYPE_INFO))
+     {
+        Shotgun_User_Info *info = iq->ev;
+
+        /* the answer is for whoever we asked, regardless of its from */
+        eina_stringshare_del(info->jid);
+        info->jid = jid;
+     }
+   else
+     {
+        if (error)
+          INF("vcard request for %s failed: %s", jid, shotgun_iq_error_str(error));
+        eina_stringshare_del(jid);
+     }
+   shotgun_iq_vcard_pump(auth);
+   return !!iq;
+}
+
+static void
+shotgun_iq_vcard_send(Shotgun_Auth *auth, const char *jid)
+{
+   size_t len;
+   const char *xml, *id;
+
+   id = shotgun_iq_request_add(auth, (Shotgun_Iq_Cb)shotgun_iq_vcard_cb, jid, SHOTGUN_IQ_TIMEOUT);
+   xml = xml_iq_write_get_vcard(auth, jid, id, &len);
+   shotgun_write(auth, xml, len);
+   auth->vcard.pending++;
+}
+
+/* send queued vcard requests until the window is full */
+void
+shotgun_iq_vcard_pump(Shotgun_Auth *auth)
+{
+   unsigned int window;
+
+   /* the rest waits for the next session */
+   if (auth->state != SHOTGUN_STATE_CONNECTED) return;
+   window = auth->vcard.window ? auth->vcard.window : SHOTGUN_VCARD_WINDOW;
+   while (auth->vcard.queue && (auth->vcard.pending < window))
+     {
+        const char *jid;
+
+        jid = eina_list_data_get(auth->vcard.queue);
+        auth->vcard.queue = eina_list_remove_list(auth->vcard.queue, auth->vcard.queue);
+        shotgun_iq_vcard_send(auth, jid);
+     }
+}
+
+static Eina_Bool
+shotgun_iq_roster_cb(void *data __UNUSED__, Shotgun_Auth *auth, Shotgun_Event_Iq *iq, Shotgun_Iq_Error error)
+{
+   if (error)
+     ERR("Roster request failed: %s", shotgun_iq_error_str(error));
+   else if (!iq) /* empty result: the stored roster is current */
+     ecore_event_add(SHOTGUN_EVENT_IQ, shotgun_roster_cached(auth), (Ecore_End_Cb)shotgun_iq_event_free, NULL);
+   return !!iq;
+}
+
 void
 shotgun_iq_feed(Shotgun_Auth *auth, char *data, size_t size)
 {
    Shotgun_Event_Iq *iq;
    Eina_List *l;
    Shotgun_User *user;
+   Shotgun_Iq_Reply reply;
 
-   iq = xml_iq_read(auth, data, size);
+   iq = xml_iq_read(auth, data, size, &reply);
+   if (!shotgun_iq_request_answer(auth, &reply, iq))
+     {
+        if (iq) shotgun_iq_event_free(NULL, iq);
+        return;
+     }
    if (!iq) return; /* no event needed */
 
    switch (iq->type)
@@ -85,7 +303,8 @@ shotgun_iq_feed(Shotgun_Auth *auth, char *data, size_t size)
            INF("User: %s", info->jid);
            INF("Full Name: %s", info->full_name);
            if (info->photo.size)
-             INF("Found image type %s: %zu bytes", info->photo.type, info->photo.size);
+             INF("Found image type %s: %zu bytes%s", info->photo.type, info->photo.size,
+                 info->photo.encoded ? " encoded" : "");
         }
       default:
         break;
@@ -97,22 +316,76 @@ Eina_Bool
 shotgun_iq_roster_get(Shotgun_Auth *auth)
 {
    size_t len;
-   char *xml;
+   const char *xml, *id;
+
+   EINA_SAFETY_ON_NULL_RETURN_VAL(auth, EINA_FALSE);
 
-   xml = xml_iq_write_preset(auth, SHOTGUN_IQ_PRESET_ROSTER, &len);
-   shotgun_write(auth->svr, xml, len);
-   free(xml);
+   shotgun_roster_load(auth);
+   id = shotgun_iq_request_add(auth, shotgun_iq_roster_cb, NULL, SHOTGUN_IQ_TIMEOUT);
+   xml = xml_iq_write_preset(auth, SHOTGUN_IQ_PRESET_ROSTER, id, &len);
+   shotgun_write(auth, xml, len);
    return EINA_TRUE;
 }
 
 Eina_Bool
 shotgun_iq_vcard_get(Shotgun_Auth *auth, const char *user)
 {
-   size_t len;
-   char *xml;
+   const char *jid, *s;
+
+   EINA_SAFETY_ON_NULL_RETURN_VAL(auth, EINA_FALSE);
+   EINA_SAFETY_ON_NULL_RETURN_VAL(user, EINA_FALSE);
+
+   s = strchr(user, '/');
+   if (s) jid = eina_stringshare_add_length(user, s - user);
+   else jid = eina_stringshare_add(user);
+
+   if (!auth->vcard.jids) auth->vcard.jids = eina_hash_stringshared_new(NULL);
+   if (eina_hash_find(auth->vcard.jids, jid))
+     {  /* already on its way */
+        eina_stringshare_del(jid);
+        return EINA_TRUE;
+     }
+   eina_hash_add(auth->vcard.jids, jid, jid);
+   auth->vcard.queue = eina_list_append(auth->vcard.queue, jid);
+   shotgun_iq_vcard_pump(auth);
+   return EINA_TRUE;
+}
+
+Eina_Bool
+shotgun_iq_vcard_get_cached(Shotgun_Auth *auth, const char *user, const char *sha1)
+{
+   Shotgun_Event_Iq *iq;
+   Shotgun_User_Info *info;
+   const char *s;
 
-   xml = xml_iq_write_get_vcard(user, &len);
-   shotgun_write(auth->svr, xml, len);
-   free(xml);
+   EINA_SAFETY_ON_NULL_RETURN_VAL(auth, EINA_FALSE);
+   EINA_SAFETY_ON_NULL_RETURN_VAL(user, EINA_FALSE);
+
+   if ((!sha1) || (!sha1[0])) return shotgun_iq_vcard_get(auth, user);
+
+   info = calloc(1, sizeof(Shotgun_User_Info));
+   if (!shotgun_avatar_load(info, sha1))
+     {
+        free(info);
+        return shotgun_iq_vcard_get(auth, user);
+     }
+   s = strchr(user, '/');
+   if (s) info->jid = eina_stringshare_add_length(user, s - user);
+   else info->jid = eina_stringshare_add(user);
+
+   iq = calloc(1, sizeof(Shotgun_Event_Iq));
+   iq->type = SHOTGUN_IQ_EVENT_TYPE_INFO;
+   iq->ev = info;
+   iq->account = auth;
+   ecore_event_add(SHOTGUN_EVENT_IQ, iq, (Ecore_End_Cb)shotgun_iq_event_free, NULL);
    return EINA_TRUE;
 }
+
+void
+shotgun_iq_vcard_window_set(Shotgun_Auth *auth, unsigned int window)
+{
+   EINA_SAFETY_ON_NULL_RETURN(auth);
+
+   auth->vcard.window = window;
+   shotgun_iq_vcard_pump(auth);
+}
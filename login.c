@@ -2,34 +2,53 @@
 #include "shotgun_private.h"
 #include "xml.h"
 
-// http://www.ietf.org/rfc/rfc4616.txt
-
-static char *
-sasl_init(Shotgun_Auth *auth, size_t *size)
+static void
+shotgun_stream_init(Shotgun_Auth *auth)
 {
-   Eina_Binbuf *buf;
-   char *ret;
+   size_t len;
+   const char *xml;
 
-   buf = eina_binbuf_new();
+   xml = xml_stream_init_create(auth, "en", &len);
+   shotgun_write(auth, xml, len);
+}
 
-   eina_binbuf_append_char(buf, 0);
-   eina_binbuf_append_length(buf, (unsigned char*)auth->user, eina_stringshare_strlen(auth->user));
-   eina_binbuf_append_char(buf, 0);
-   eina_binbuf_append_length(buf, (unsigned char*)auth->pass, strlen(auth->pass));
-   ret = shotgun_base64_encode(eina_binbuf_string_get(buf), eina_binbuf_length_get(buf), size);
-   eina_binbuf_free(buf);
-   return ret;
+static Eina_Bool
+shotgun_login_bind_cb(void *data __UNUSED__, Shotgun_Auth *auth, Shotgun_Event_Iq *iq __UNUSED__, Shotgun_Iq_Error error)
+{
+   if (error == SHOTGUN_IQ_ERROR_DISCONNECTED) return EINA_FALSE; /* shotgun_reconnect() has it */
+   if (error || (!auth->bind))
+     {
+        ERR("Bind failed: %s", shotgun_iq_error_str(error));
+        ecore_main_loop_quit();
+        return EINA_FALSE;
+     }
+   INF("Bind: %s", auth->bind);
+   INF("Login complete!");
+   auth->state = SHOTGUN_STATE_CONNECTED;
+   auth->reconnect.attempts = 0;
+   shotgun_sm_enable(auth);
+   shotgun_iq_vcard_pump(auth);
+   ecore_event_add(SHOTGUN_EVENT_CONNECT, auth, shotgun_fake_free, NULL);
+   return EINA_FALSE;
 }
 
-static void
-shotgun_stream_init(Shotgun_Auth *auth)
+static Eina_Bool
+shotgun_login_bind(Shotgun_Auth *auth)
 {
+   const char *xml;
    size_t len;
-   char *xml;
 
-   xml = xml_stream_init_create(auth, "en", &len);
-   shotgun_write(auth->svr, xml, len - 1);
-   free(xml);
+   xml = xml_iq_write_preset(auth, SHOTGUN_IQ_PRESET_BIND,
+                             shotgun_iq_request_add(auth, shotgun_login_bind_cb, NULL, SHOTGUN_IQ_TIMEOUT), &len);
+   EINA_SAFETY_ON_NULL_RETURN_VAL(xml, EINA_FALSE);
+
+   shotgun_write(auth, xml, len);
+   if (auth->pipeline)
+     {  /* the server gets to these once the bind is done */
+        shotgun_iq_roster_get(auth);
+        if (auth->status) shotgun_presence_send(auth);
+     }
+   return EINA_TRUE;
 }
 
 Eina_Bool
@@ -38,92 +57,85 @@ shotgun_login_con(Shotgun_Auth *auth, int type, Ecore_Con_Event_Server_Add *ev)
    if (auth != ecore_con_server_data_get(ev->server))
      return ECORE_CALLBACK_PASS_ON;
 
-   if (type == ECORE_CON_EVENT_SERVER_ADD)
-     INF("Connected!");
-   else
+   if (type != ECORE_CON_EVENT_SERVER_ADD)
      {
         INF("STARTTLS succeeded!");
         auth->state++;
      }
+   else if (auth->tls.direct && (!auth->tls.failed))
+     {  /* the handshake is done already, skip to the features */
+        INF("Connected with TLS!");
+        auth->state = SHOTGUN_STATE_FEATURES;
+     }
+   else
+     INF("Connected!");
    auth->svr = ev->server;
    shotgun_stream_init(auth);
    return ECORE_CALLBACK_RENEW;
 }
 
 void
-shotgun_login(Shotgun_Auth *auth, Ecore_Con_Event_Server_Data *ev)
+shotgun_login(Shotgun_Auth *auth, char *data, size_t size)
 {
-   char *out;
-   size_t len;
-
    switch (auth->state)
      {
       case SHOTGUN_STATE_NONE:
-        if (!xml_stream_init_read(auth, ev->data, ev->size)) break;
+        if (!xml_stream_init_read(auth, data, size)) break;
 
         if (auth->features.starttls)
           {
              auth->state = SHOTGUN_STATE_TLS;
-             shotgun_write(ev->server, XML_STARTTLS, sizeof(XML_STARTTLS) - 1);
+             shotgun_write(auth, XML_STARTTLS, sizeof(XML_STARTTLS) - 1);
           }
         else /* who cares */
           ecore_main_loop_quit();
         break;
       case SHOTGUN_STATE_TLS:
-        if (xml_starttls_read(ev->data, ev->size))
-          ecore_con_ssl_server_upgrade(ev->server, ECORE_CON_USE_MIXED);
+        if (xml_starttls_read(data, size))
+          ecore_con_ssl_server_upgrade(auth->svr, ECORE_CON_USE_MIXED);
         else
           ecore_main_loop_quit();
         return;
 
       case SHOTGUN_STATE_FEATURES:
-        if (!xml_stream_init_read(auth, ev->data, ev->size)) break;
-        out = sasl_init(auth, &len);
-        if (!out) ecore_main_loop_quit();
-        else
-          {
-             char *send;
-
-             send = xml_sasl_write(out, &len);
-#ifdef SHOTGUN_AUTH_VISIBLE
-             shotgun_write(ev->server, send, len);
-#else
-             ecore_con_server_send(ev->server, send, len);
-#endif
-             free(out);
-             free(send);
-             auth->state++;
-          }
+        if (!xml_stream_init_read(auth, data, size)) break;
+        if (!shotgun_sasl_start(auth)) goto error;
+        auth->state++;
         break;
       case SHOTGUN_STATE_SASL:
-        if (!xml_sasl_read(ev->data, ev->size))
+        switch (shotgun_sasl_feed(auth, data, size))
           {
+           case SHOTGUN_SASL_CHALLENGE: /* answered */
+             break;
+           case SHOTGUN_SASL_SUCCESS:
+             /* yes, another stream. */
+             shotgun_stream_init(auth);
+             auth->state++;
+             break;
+           default:
              ERR("Login failed!");
              ecore_main_loop_quit();
              break;
           }
-        /* yes, another stream. */
-        shotgun_stream_init(auth);
-        auth->state++;
         break;
       case SHOTGUN_STATE_BIND:
-        if (!xml_stream_init_read(auth, ev->data, ev->size))
+        if (!xml_stream_init_read(auth, data, size))
           break;
 
-        out = xml_iq_write_preset(auth, SHOTGUN_IQ_PRESET_BIND, &len);
-        EINA_SAFETY_ON_NULL_GOTO(out, error);
-
-        shotgun_write(ev->server, out, strlen(out));
-        free(out);
+        /* before the bind goes out, so that stanzas can follow it */
         auth->state++;
+        if ((!shotgun_sm_resume(auth)) && (!shotgun_login_bind(auth))) goto error;
         break;
       case SHOTGUN_STATE_CONNECTING:
-        xml_iq_read(auth, ev->data, ev->size);
-        EINA_SAFETY_ON_NULL_GOTO(auth->bind, error);
-        INF("Bind: %s", auth->bind);
-        INF("Login complete!");
-        auth->state++;
-        ecore_event_add(SHOTGUN_EVENT_CONNECT, auth, shotgun_fake_free, NULL);
+        /* shotgun_login_bind_cb or <resumed/> finishes the login */
+        if (data[1] == 'i') shotgun_iq_feed(auth, data, size);
+        else if (auth->sm.resuming && shotgun_sm_feed(auth, data, size) &&
+                 (!auth->sm.resuming) && (auth->state != SHOTGUN_STATE_CONNECTED))
+          {  /* the old session is gone, and with it any answers */
+             shotgun_iq_requests_cancel(auth);
+             if (!shotgun_login_bind(auth)) goto error;
+          }
+        break;
       default:
         break;
      }
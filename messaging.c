@@ -47,10 +47,9 @@ Eina_Bool
 shotgun_message_send(Shotgun_Auth *auth, const char *to, const char *msg, Shotgun_Message_Status status)
 {
    size_t len;
-   char *xml;
+   const char *xml;
 
    xml = xml_message_write(auth, to, msg, status, &len);
-   shotgun_write(auth->svr, xml, len);
-   free(xml);
+   shotgun_write(auth, xml, len);
    return EINA_TRUE;
 }
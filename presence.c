@@ -131,11 +131,10 @@ Eina_Bool
 shotgun_presence_send(Shotgun_Auth *auth)
 {
    size_t len;
-   char *xml;
+   const char *xml;
 
    xml = xml_presence_write(auth, &len);
-   shotgun_write(auth->svr, xml, len);
-   free(xml);
+   shotgun_write(auth, xml, len);
    return EINA_TRUE;
 }
 
@@ -0,0 +1,232 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "shotgun_private.h"
+
+/* XEP-0237 roster versioning.
+ * the last roster seen is kept in $XDG_CACHE_HOME/shotgun/roster/<user@domain>
+ * so that the server only has to send what changed since its version:
+ *
+ * "SGR1" <u16 len> ver
+ * { <u8 subscription> <u16 len> jid <u16 len> name } ...
+ */
+
+#define ROSTER_MAGIC "SGR1"
+
+static Eina_Bool
+shotgun_roster_path(Shotgun_Auth *auth, char *path, size_t size)
+{
+   char dir[PATH_MAX];
+   char *p;
+
+   if (!shotgun_cache_dir(dir, sizeof(dir), "roster")) return EINA_FALSE;
+   snprintf(path, size, "%s/%s@%s", dir, auth->user, auth->from);
+   for (p = path + strlen(dir) + 1; *p; p++)
+     if (*p == '/') *p = '_';
+   return EINA_TRUE;
+}
+
+static Shotgun_User *
+shotgun_roster_user_dup(Shotgun_Auth *auth, const Shotgun_User *user, Shotgun_User_Subscription sub)
+{
+   Shotgun_User *ret;
+
+   ret = calloc(1, sizeof(Shotgun_User));
+   ret->jid = eina_stringshare_ref(user->jid);
+   ret->name = eina_stringshare_ref(user->name);
+   ret->subscription = sub;
+   ret->account = auth;
+   return ret;
+}
+
+static void
+shotgun_roster_put16(Eina_Binbuf *buf, const char *str)
+{
+   size_t len = str ? eina_stringshare_strlen(str) : 0;
+
+   if (len > 0xffff) len = 0xffff;
+   eina_binbuf_append_char(buf, len >> 8);
+   eina_binbuf_append_char(buf, len & 0xff);
+   if (len) eina_binbuf_append_length(buf, (const unsigned char*)str, len);
+}
+
+static const char *
+shotgun_roster_get16(const unsigned char **p, const unsigned char *end)
+{
+   size_t len;
+   const char *ret;
+
+   if (end - *p < 2) return NULL;
+   len = ((*p)[0] << 8) | (*p)[1];
+   if ((size_t)(end - *p - 2) < len) return NULL;
+   ret = eina_stringshare_add_length((const char*)*p + 2, len);
+   *p += 2 + len;
+   return ret;
+}
+
+static Eina_Bool
+shotgun_roster_save_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Shotgun_User *user, Eina_Binbuf *buf)
+{
+   eina_binbuf_append_char(buf, user->subscription);
+   shotgun_roster_put16(buf, user->jid);
+   shotgun_roster_put16(buf, user->name);
+   return EINA_TRUE;
+}
+
+static void
+shotgun_roster_save(Shotgun_Auth *auth)
+{
+   char path[PATH_MAX];
+   Eina_Binbuf *buf;
+
+   /* without a version the server always sends everything anyway */
+   if (!auth->roster.ver) return;
+   if (!shotgun_roster_path(auth, path, sizeof(path))) return;
+
+   buf = eina_binbuf_new();
+   eina_binbuf_append_length(buf, (const unsigned char*)ROSTER_MAGIC, sizeof(ROSTER_MAGIC) - 1);
+   shotgun_roster_put16(buf, auth->roster.ver);
+   eina_hash_foreach(auth->roster.users, (Eina_Hash_Foreach)shotgun_roster_save_cb, buf);
+   if (shotgun_file_write(path, eina_binbuf_string_get(buf), eina_binbuf_length_get(buf)))
+     DBG("Saved roster version %s", auth->roster.ver);
+   eina_binbuf_free(buf);
+}
+
+/* reads the stored roster, if any, the first time it is needed */
+void
+shotgun_roster_load(Shotgun_Auth *auth)
+{
+   char path[PATH_MAX];
+   const unsigned char *map, *p, *end;
+   struct stat st;
+   int fd;
+
+   if (auth->roster.users) return;
+   auth->roster.users = eina_hash_stringshared_new((Eina_Free_Cb)shotgun_user_free);
+
+   if (!shotgun_roster_path(auth, path, sizeof(path))) return;
+   fd = open(path, O_RDONLY);
+   if (fd < 0) return;
+   if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(ROSTER_MAGIC) + 1))
+     {
+        close(fd);
+        return;
+     }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) return;
+
+   p = map + sizeof(ROSTER_MAGIC) - 1;
+   end = map + st.st_size;
+   if (memcmp(map, ROSTER_MAGIC, sizeof(ROSTER_MAGIC) - 1) ||
+       (!(auth->roster.ver = shotgun_roster_get16(&p, end))))
+     {
+        ERR("Discarding unreadable roster %s", path);
+        goto out;
+     }
+   while (p < end)
+     {
+        Shotgun_User *user;
+
+        user = calloc(1, sizeof(Shotgun_User));
+        user->account = auth;
+        user->subscription = *p++;
+        user->jid = shotgun_roster_get16(&p, end);
+        user->name = shotgun_roster_get16(&p, end);
+        if ((!user->jid) || (!user->jid[0]) || (!user->name) || (user->subscription > SHOTGUN_USER_SUBSCRIPTION_BOTH))
+          {
+             ERR("Discarding unreadable roster %s", path);
+             shotgun_user_free(user);
+             eina_hash_free_buckets(auth->roster.users);
+             eina_stringshare_replace(&auth->roster.ver, NULL);
+             break;
+          }
+        if (!user->name[0]) eina_stringshare_replace(&user->name, NULL);
+        eina_hash_add(auth->roster.users, user->jid, user);
+     }
+   INF("Loaded %d roster items, version %s", eina_hash_population(auth->roster.users), auth->roster.ver);
+out:
+   munmap((void*)map, st.st_size);
+}
+
+static Shotgun_Event_Iq *
+shotgun_roster_event(Shotgun_Auth *auth, Eina_List *users)
+{
+   Shotgun_Event_Iq *ret;
+
+   ret = calloc(1, sizeof(Shotgun_Event_Iq));
+   ret->type = SHOTGUN_IQ_EVENT_TYPE_ROSTER;
+   ret->ev = users;
+   ret->account = auth;
+   return ret;
+}
+
+static Eina_Bool
+shotgun_roster_dup_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Shotgun_User *user, Eina_List **list)
+{
+   *list = eina_list_append(*list, shotgun_roster_user_dup(user->account, user, user->subscription));
+   return EINA_TRUE;
+}
+
+static Eina_Bool
+shotgun_roster_removed_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Shotgun_User *user, Eina_List **list)
+{
+   *list = eina_list_append(*list, shotgun_roster_user_dup(user->account, user, SHOTGUN_USER_SUBSCRIPTION_REMOVE));
+   return EINA_TRUE;
+}
+
+/* the server says our stored roster is current */
+Shotgun_Event_Iq *
+shotgun_roster_cached(Shotgun_Auth *auth)
+{
+   Eina_List *list = NULL;
+
+   shotgun_roster_load(auth);
+   INF("Roster version %s is current", auth->roster.ver);
+   eina_hash_foreach(auth->roster.users, (Eina_Hash_Foreach)shotgun_roster_dup_cb, &list);
+   return shotgun_roster_event(auth, list);
+}
+
+/* merges users into the stored roster.
+ * a full roster replaces it, anything else is a push of changed items.
+ * returns an event carrying every change, removals included
+ */
+Shotgun_Event_Iq *
+shotgun_roster_apply(Shotgun_Auth *auth, Eina_List *users, const char *ver, Eina_Bool full)
+{
+   Eina_List *changes = NULL;
+   Eina_Hash *old = NULL;
+   Shotgun_User *user;
+
+   shotgun_roster_load(auth);
+   if (full)
+     {
+        old = auth->roster.users;
+        auth->roster.users = eina_hash_stringshared_new((Eina_Free_Cb)shotgun_user_free);
+     }
+   EINA_LIST_FREE(users, user)
+     {
+        if (old) eina_hash_del_by_key(old, user->jid);
+        if (user->subscription == SHOTGUN_USER_SUBSCRIPTION_REMOVE)
+          {
+             eina_hash_del_by_key(auth->roster.users, user->jid);
+             changes = eina_list_append(changes, user);
+             continue;
+          }
+        changes = eina_list_append(changes, shotgun_roster_user_dup(auth, user, user->subscription));
+        shotgun_user_free(eina_hash_set(auth->roster.users, user->jid, user));
+     }
+   if (old)
+     {  /* whatever the new roster doesn't have was removed meanwhile */
+        eina_hash_foreach(old, (Eina_Hash_Foreach)shotgun_roster_removed_cb, &changes);
+        eina_hash_free(old);
+     }
+   if (ver) eina_stringshare_replace(&auth->roster.ver, ver);
+   shotgun_roster_save(auth);
+   return shotgun_roster_event(auth, changes);
+}
@@ -0,0 +1,456 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <Ecore.h>
+#include "shotgun_private.h"
+#include "xml.h"
+
+/* SASL, rfc6120 section 6.
+ * the strongest mechanism the server offers is used: SCRAM-SHA-256 (rfc7677),
+ * then SCRAM-SHA-1 (rfc5802), then PLAIN (rfc4616), which is also tried on
+ * servers that offer nothing we know.
+ *
+ * SCRAM never sends the password and makes the server prove it knows it too.
+ * turning the password into a key takes thousands of HMAC rounds, so the
+ * key is kept for as long as the server sends the same salt and iteration
+ * count: logins after a reconnect only cost a handful of hashes.
+ */
+
+/* more than this is a server trying to keep us busy */
+#define SCRAM_ITERATIONS_MAX 1000000
+/* random bytes in our nonce, 24 characters of base64 */
+#define SCRAM_NONCE_SIZE 18
+
+typedef union
+{
+   Shotgun_Sha1 sha1;
+   Shotgun_Sha256 sha256;
+} Shotgun_Sasl_Hash_Ctx;
+
+typedef struct
+{
+   Shotgun_Sasl_Mech mech;
+   const char *name;
+   size_t size; /* of a digest */
+   void (*init)(void *ctx);
+   void (*update)(void *ctx, const void *data, size_t size);
+   void (*final)(void *ctx, unsigned char *digest);
+} Shotgun_Sasl_Hash;
+
+/* strongest first */
+static const Shotgun_Sasl_Hash shotgun_sasl_hashes[] =
+{
+   {
+      SHOTGUN_SASL_MECH_SCRAM_SHA_256, "SCRAM-SHA-256", 32,
+      (void (*)(void*))shotgun_sha256_init,
+      (void (*)(void*, const void*, size_t))shotgun_sha256_update,
+      (void (*)(void*, unsigned char*))shotgun_sha256_final
+   },
+   {
+      SHOTGUN_SASL_MECH_SCRAM_SHA_1, "SCRAM-SHA-1", 20,
+      (void (*)(void*))shotgun_sha1_init,
+      (void (*)(void*, const void*, size_t))shotgun_sha1_update,
+      (void (*)(void*, unsigned char*))shotgun_sha1_final
+   }
+};
+
+static const Shotgun_Sasl_Hash *
+shotgun_sasl_hash_get(Shotgun_Sasl_Mech mech)
+{
+   unsigned int i;
+
+   for (i = 0; i < sizeof(shotgun_sasl_hashes) / sizeof(shotgun_sasl_hashes[0]); i++)
+     if (shotgun_sasl_hashes[i].mech & mech) return &shotgun_sasl_hashes[i];
+   return NULL;
+}
+
+/* HMAC, rfc2104, keyed once and used any number of times.
+ * both hashes work on 64 byte blocks
+ */
+typedef struct
+{
+   const Shotgun_Sasl_Hash *hash;
+   Shotgun_Sasl_Hash_Ctx inner, outer; /* with the padded key already fed */
+} Shotgun_Hmac;
+
+static void
+shotgun_hmac_init(Shotgun_Hmac *hmac, const Shotgun_Sasl_Hash *hash, const void *key, size_t size)
+{
+   unsigned char pad[64], digest[32];
+   unsigned int i;
+
+   hmac->hash = hash;
+   if (size > sizeof(pad))
+     {
+        hash->init(&hmac->inner);
+        hash->update(&hmac->inner, key, size);
+        hash->final(&hmac->inner, digest);
+        key = digest;
+        size = hash->size;
+     }
+   memset(pad, 0, sizeof(pad));
+   memcpy(pad, key, size);
+   for (i = 0; i < sizeof(pad); i++)
+     pad[i] ^= 0x36;
+   hash->init(&hmac->inner);
+   hash->update(&hmac->inner, pad, sizeof(pad));
+   for (i = 0; i < sizeof(pad); i++)
+     pad[i] ^= 0x36 ^ 0x5c;
+   hash->init(&hmac->outer);
+   hash->update(&hmac->outer, pad, sizeof(pad));
+   memset(pad, 0, sizeof(pad));
+   memset(digest, 0, sizeof(digest));
+}
+
+/* digest may be data */
+static void
+shotgun_hmac(const Shotgun_Hmac *hmac, const void *data, size_t size, unsigned char *digest)
+{
+   Shotgun_Sasl_Hash_Ctx ctx;
+
+   ctx = hmac->inner;
+   hmac->hash->update(&ctx, data, size);
+   hmac->hash->final(&ctx, digest);
+   ctx = hmac->outer;
+   hmac->hash->update(&ctx, digest, hmac->hash->size);
+   hmac->hash->final(&ctx, digest);
+}
+
+/* PBKDF2 (rfc2898) with a single block of output, Hi() in rfc5802 */
+static void
+shotgun_pbkdf2(const Shotgun_Sasl_Hash *hash, const char *pass, const unsigned char *salt, size_t size,
+               unsigned int iterations, unsigned char *key)
+{
+   Shotgun_Hmac hmac;
+   Shotgun_Sasl_Hash_Ctx ctx;
+   unsigned char u[32];
+   unsigned int i, j;
+
+   shotgun_hmac_init(&hmac, hash, pass, strlen(pass));
+   ctx = hmac.inner;
+   hash->update(&ctx, salt, size);
+   hash->update(&ctx, "\0\0\0\1", 4);
+   hash->final(&ctx, u);
+   ctx = hmac.outer;
+   hash->update(&ctx, u, hash->size);
+   hash->final(&ctx, u);
+   memcpy(key, u, hash->size);
+   for (i = 1; i < iterations; i++)
+     {
+        shotgun_hmac(&hmac, u, hash->size, u);
+        for (j = 0; j < hash->size; j++)
+          key[j] ^= u[j];
+     }
+   memset(u, 0, sizeof(u));
+   memset(&hmac, 0, sizeof(hmac));
+}
+
+static void
+shotgun_sasl_send(Shotgun_Auth *auth, const char *xml, size_t len)
+{
+#ifdef SHOTGUN_AUTH_VISIBLE
+   shotgun_write(auth, xml, len);
+#else
+   shotgun_queue(auth, xml, len);
+#endif
+}
+
+static Eina_Bool
+shotgun_sasl_nonce(char *nonce)
+{
+   unsigned char bytes[SCRAM_NONCE_SIZE];
+   ssize_t n = -1;
+   int fd;
+
+   fd = open("/dev/urandom", O_RDONLY);
+   if (fd >= 0)
+     {
+        n = read(fd, bytes, sizeof(bytes));
+        close(fd);
+     }
+   if (n != sizeof(bytes))
+     {
+        ERR("Could not read /dev/urandom");
+        return EINA_FALSE;
+     }
+   nonce[shotgun_base64_encode_buf(bytes, sizeof(bytes), nonce)] = 0;
+   return EINA_TRUE;
+}
+
+/* the PBKDF2 output for this salt, from the last login if it used the same */
+static const unsigned char *
+shotgun_sasl_salted(Shotgun_Auth *auth, const Shotgun_Sasl_Hash *hash, const char *salt, size_t size,
+                    unsigned int iterations)
+{
+   unsigned char *raw;
+   size_t raw_size;
+   double t;
+
+   if ((auth->sasl.salted.mech == hash->mech) && (auth->sasl.salted.iterations == iterations) &&
+       auth->sasl.salted.salt && (eina_stringshare_strlen(auth->sasl.salted.salt) == (int)size) &&
+       (!memcmp(auth->sasl.salted.salt, salt, size)))
+     {
+        DBG("Reusing salted password");
+        return auth->sasl.salted.key;
+     }
+
+   raw = shotgun_base64_decode(salt, size, &raw_size);
+   if (!raw)
+     {
+        ERR("Undecodable SCRAM salt");
+        return NULL;
+     }
+   t = ecore_time_get();
+   shotgun_pbkdf2(hash, auth->pass, raw, raw_size, iterations, auth->sasl.salted.key);
+   free(raw);
+   DBG("Salted password with %u iterations in %.3fs", iterations, ecore_time_get() - t);
+   eina_stringshare_del(auth->sasl.salted.salt);
+   auth->sasl.salted.salt = eina_stringshare_add_length(salt, size);
+   auth->sasl.salted.mech = hash->mech;
+   auth->sasl.salted.iterations = iterations;
+   return auth->sasl.salted.key;
+}
+
+/* answers server-first-message with client-final-message */
+static Eina_Bool
+shotgun_sasl_scram_final(Shotgun_Auth *auth, const char *server)
+{
+   const Shotgun_Sasl_Hash *hash;
+   const unsigned char *salted;
+   const char *p, *end, *nonce = NULL, *salt = NULL, *cnonce;
+   size_t nonce_size = 0, salt_size = 0, len;
+   unsigned long iterations = 0;
+   unsigned char client_key[32], stored_key[32], server_key[32], proof[32];
+   char proof64[48];
+   Shotgun_Sasl_Hash_Ctx ctx;
+   Shotgun_Hmac hmac;
+   Eina_Strbuf *msg, *final;
+   const char *xml;
+   unsigned int i;
+
+   hash = shotgun_sasl_hash_get(auth->sasl.mech);
+   for (p = server; *p; p = *end ? end + 1 : end)
+     {
+        end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+        if ((end - p < 2) || (p[1] != '=')) break;
+        switch (p[0])
+          {
+           case 'r':
+             nonce = p + 2;
+             nonce_size = end - nonce;
+             break;
+           case 's':
+             salt = p + 2;
+             salt_size = end - salt;
+             break;
+           case 'i':
+             iterations = strtoul(p + 2, NULL, 10);
+             break;
+           case 'm':
+             ERR("Unsupported SCRAM extension");
+             return EINA_FALSE;
+           default:
+             break;
+          }
+     }
+   /* the server's nonce has to start with ours */
+   cnonce = strstr(auth->sasl.first, ",r=") + 3;
+   len = strlen(cnonce);
+   if ((!nonce) || (nonce_size <= len) || memcmp(nonce, cnonce, len) || (!salt_size))
+     {
+        ERR("Bad SCRAM challenge: %s", server);
+        return EINA_FALSE;
+     }
+   if ((!iterations) || (iterations > SCRAM_ITERATIONS_MAX))
+     {
+        ERR("Refusing %lu SCRAM iterations", iterations);
+        return EINA_FALSE;
+     }
+   salted = shotgun_sasl_salted(auth, hash, salt, salt_size, iterations);
+   if (!salted) return EINA_FALSE;
+
+   shotgun_hmac_init(&hmac, hash, salted, hash->size);
+   shotgun_hmac(&hmac, "Client Key", sizeof("Client Key") - 1, client_key);
+   shotgun_hmac(&hmac, "Server Key", sizeof("Server Key") - 1, server_key);
+   hash->init(&ctx);
+   hash->update(&ctx, client_key, hash->size);
+   hash->final(&ctx, stored_key);
+
+   /* "biws" is "n,,", the gs2 header sent with client-first-message */
+   final = eina_strbuf_new();
+   eina_strbuf_append_printf(final, "c=biws,r=%.*s", (int)nonce_size, nonce);
+   msg = eina_strbuf_new();
+   eina_strbuf_append_printf(msg, "%s,%s,%s", auth->sasl.first, server, eina_strbuf_string_get(final));
+
+   shotgun_hmac_init(&hmac, hash, stored_key, hash->size);
+   shotgun_hmac(&hmac, eina_strbuf_string_get(msg), eina_strbuf_length_get(msg), proof);
+   for (i = 0; i < hash->size; i++)
+     proof[i] ^= client_key[i];
+   shotgun_hmac_init(&hmac, hash, server_key, hash->size);
+   shotgun_hmac(&hmac, eina_strbuf_string_get(msg), eina_strbuf_length_get(msg), auth->sasl.signature);
+
+   proof64[shotgun_base64_encode_buf(proof, hash->size, proof64)] = 0;
+   eina_strbuf_append_printf(final, ",p=%s", proof64);
+   xml = xml_sasl_response_write(auth, eina_strbuf_string_get(final), eina_strbuf_length_get(final), &len);
+   shotgun_sasl_send(auth, xml, len);
+
+   eina_strbuf_free(final);
+   eina_strbuf_free(msg);
+   memset(client_key, 0, sizeof(client_key));
+   memset(stored_key, 0, sizeof(stored_key));
+   memset(server_key, 0, sizeof(server_key));
+   memset(&hmac, 0, sizeof(hmac));
+   /* from now on, the server has to prove itself */
+   free(auth->sasl.first);
+   auth->sasl.first = NULL;
+   auth->sasl.step = SHOTGUN_SASL_STEP_FINAL;
+   return EINA_TRUE;
+}
+
+/* checks server-final-message */
+static Eina_Bool
+shotgun_sasl_scram_verify(Shotgun_Auth *auth, const char *server)
+{
+   const Shotgun_Sasl_Hash *hash;
+   unsigned char signature[48];
+   size_t len;
+
+   hash = shotgun_sasl_hash_get(auth->sasl.mech);
+   if (!server) return EINA_FALSE;
+   if (!strncmp(server, "e=", 2))
+     {
+        ERR("SCRAM error: %s", server + 2);
+        return EINA_FALSE;
+     }
+   len = strlen(server);
+   if ((len < 2) || strncmp(server, "v=", 2) || (len - 2 > 64) ||
+       (shotgun_base64_decode_buf(server + 2, len - 2, signature) != (ssize_t)hash->size) ||
+       memcmp(signature, auth->sasl.signature, hash->size))
+     {
+        ERR("Server could not prove it knows the password!");
+        return EINA_FALSE;
+     }
+   return EINA_TRUE;
+}
+
+/* sends <auth/> with the best mechanism on offer */
+Eina_Bool
+shotgun_sasl_start(Shotgun_Auth *auth)
+{
+   const Shotgun_Sasl_Hash *hash;
+   Eina_Strbuf *buf;
+   const char *xml, *p;
+   char nonce[(SCRAM_NONCE_SIZE + 2) / 3 * 4 + 1];
+   size_t len;
+
+   free(auth->sasl.first);
+   auth->sasl.first = NULL;
+
+   hash = shotgun_sasl_hash_get(auth->features.mechs);
+   if (!hash)
+     {  /* authzid NUL authcid NUL passwd */
+        size_t ulen, plen;
+        char *msg;
+
+        ulen = eina_stringshare_strlen(auth->user);
+        plen = strlen(auth->pass);
+        msg = malloc(ulen + plen + 2);
+        if (!msg) return EINA_FALSE;
+        msg[0] = 0;
+        memcpy(msg + 1, auth->user, ulen);
+        msg[ulen + 1] = 0;
+        memcpy(msg + ulen + 2, auth->pass, plen);
+        xml = xml_sasl_write(auth, "PLAIN", msg, ulen + plen + 2, &len);
+        memset(msg, 0, ulen + plen + 2);
+        free(msg);
+        auth->sasl.mech = SHOTGUN_SASL_MECH_PLAIN;
+        shotgun_sasl_send(auth, xml, len);
+        return EINA_TRUE;
+     }
+
+   if (!shotgun_sasl_nonce(nonce)) return EINA_FALSE;
+   INF("Authenticating with %s", hash->name);
+   /* gs2 header: no channel binding, no authzid */
+   buf = eina_strbuf_new();
+   eina_strbuf_append(buf, "n,,n=");
+   for (p = auth->user; *p; p++)
+     {
+        if (*p == '=') eina_strbuf_append(buf, "=3D");
+        else if (*p == ',') eina_strbuf_append(buf, "=2C");
+        else eina_strbuf_append_char(buf, *p);
+     }
+   eina_strbuf_append_printf(buf, ",r=%s", nonce);
+   auth->sasl.first = strdup(eina_strbuf_string_get(buf) + 3);
+   auth->sasl.mech = hash->mech;
+   auth->sasl.step = SHOTGUN_SASL_STEP_FIRST;
+   xml = xml_sasl_write(auth, hash->name, eina_strbuf_string_get(buf), eina_strbuf_length_get(buf), &len);
+   shotgun_sasl_send(auth, xml, len);
+   eina_strbuf_free(buf);
+   return EINA_TRUE;
+}
+
+/* handles what the server sends during SASL. a challenge is answered,
+ * a success is only returned once the server has proven itself
+ */
+Shotgun_Sasl_Type
+shotgun_sasl_feed(Shotgun_Auth *auth, char *data, size_t size)
+{
+   Shotgun_Sasl_Type type;
+   const char *xml;
+   char *msg;
+   size_t len;
+
+   type = xml_sasl_read(auth, data, size, &msg, &len);
+   switch (type)
+     {
+      case SHOTGUN_SASL_CHALLENGE:
+        if ((auth->sasl.mech == SHOTGUN_SASL_MECH_PLAIN) || (!msg))
+          type = SHOTGUN_SASL_FAILURE;
+        else if (auth->sasl.step == SHOTGUN_SASL_STEP_FIRST)
+          {
+             if (!shotgun_sasl_scram_final(auth, msg)) type = SHOTGUN_SASL_FAILURE;
+          }
+        else if ((auth->sasl.step == SHOTGUN_SASL_STEP_FINAL) && shotgun_sasl_scram_verify(auth, msg))
+          {  /* the verifier may come as a challenge, <success/> follows an empty response */
+             xml = xml_sasl_response_write(auth, NULL, 0, &len);
+             shotgun_sasl_send(auth, xml, len);
+             auth->sasl.step = SHOTGUN_SASL_STEP_VERIFIED;
+          }
+        else
+          type = SHOTGUN_SASL_FAILURE;
+        break;
+      case SHOTGUN_SASL_SUCCESS:
+        /* or with the success, unless a challenge had it already */
+        if ((auth->sasl.mech != SHOTGUN_SASL_MECH_PLAIN) && (auth->sasl.step != SHOTGUN_SASL_STEP_VERIFIED) &&
+            ((auth->sasl.step != SHOTGUN_SASL_STEP_FINAL) || (!shotgun_sasl_scram_verify(auth, msg))))
+          type = SHOTGUN_SASL_FAILURE;
+        break;
+      default:
+        type = SHOTGUN_SASL_FAILURE;
+        break;
+     }
+   free(msg);
+   if (type != SHOTGUN_SASL_CHALLENGE)
+     {
+        free(auth->sasl.first);
+        auth->sasl.first = NULL;
+        memset(auth->sasl.signature, 0, sizeof(auth->sasl.signature));
+     }
+   return type;
+}
+
+/* drops everything derived from the password */
+void
+shotgun_sasl_forget(Shotgun_Auth *auth)
+{
+   free(auth->sasl.first);
+   auth->sasl.first = NULL;
+   memset(auth->sasl.signature, 0, sizeof(auth->sasl.signature));
+   eina_stringshare_replace(&auth->sasl.salted.salt, NULL);
+   memset(auth->sasl.salted.key, 0, sizeof(auth->sasl.salted.key));
+   auth->sasl.salted.mech = 0;
+   auth->sasl.salted.iterations = 0;
+}
@@ -3,29 +3,112 @@
 #include <Ecore_Con.h>
 
 #include <ctype.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "xml.h"
 
 int shotgun_log_dom = -1;
 
 int SHOTGUN_EVENT_CONNECT = 0;
+int SHOTGUN_EVENT_RECONNECT = 0;
 int SHOTGUN_EVENT_MESSAGE = 0;
 int SHOTGUN_EVENT_PRESENCE = 0;
 int SHOTGUN_EVENT_IQ = 0;
 
+/* queued output is sent as soon as it grows past this */
+#define SHOTGUN_FLUSH_SIZE (16 * 1024)
+
+/* seconds between connection attempts: doubled after each failed one, up to the max */
+#define SHOTGUN_RECONNECT_MIN 1.0
+#define SHOTGUN_RECONNECT_MAX 300.0
+
+#define SHOTGUN_PORT 5222
+#define SHOTGUN_PORT_TLS 5223
+
+static void
+shotgun_connect(Shotgun_Auth *auth)
+{
+   if (auth->tls.direct && (!auth->tls.failed))
+     auth->svr = ecore_con_server_connect(ECORE_CON_REMOTE_NODELAY | ECORE_CON_USE_MIXED,
+                                          "talk.google.com", SHOTGUN_PORT_TLS, auth);
+   else
+     auth->svr = ecore_con_server_connect(ECORE_CON_REMOTE_NODELAY, "talk.google.com", SHOTGUN_PORT, auth);
+}
+
+static void shotgun_reconnect(Shotgun_Auth *auth);
+
+static Eina_Bool
+shotgun_reconnect_cb(Shotgun_Auth *auth)
+{
+   auth->reconnect.timer = NULL;
+   INF("Reconnecting, attempt %u", auth->reconnect.attempts);
+   shotgun_connect(auth);
+   /* no DEL event comes for a connection that never started */
+   if (!auth->svr) shotgun_reconnect(auth);
+   return EINA_FALSE;
+}
+
+/* starts over on a new connection, keeping what stream management needs to resume.
+ * attempts are spread out exponentially, with half of each delay random so that
+ * clients dropped together don't all come back at once
+ */
+static void
+shotgun_reconnect(Shotgun_Auth *auth)
+{
+   double delay;
+
+   if (auth->flush_job) ecore_job_del(auth->flush_job);
+   auth->flush_job = NULL;
+   if (auth->out) eina_strbuf_reset(auth->out);
+   if (auth->buf) eina_strbuf_reset(auth->buf);
+   memset(&auth->tok, 0, sizeof(auth->tok));
+   memset(&auth->features, 0, sizeof(auth->features));
+   eina_stringshare_replace(&auth->bind, NULL);
+   auth->state = SHOTGUN_STATE_NONE;
+
+   if (!auth->reconnect.seed) auth->reconnect.seed = getpid() ^ time(NULL);
+   delay = SHOTGUN_RECONNECT_MIN;
+   if (auth->reconnect.attempts < 16)
+     delay *= 1 << auth->reconnect.attempts;
+   if (delay > SHOTGUN_RECONNECT_MAX) delay = SHOTGUN_RECONNECT_MAX;
+   delay = delay / 2 + (delay / 2) * rand_r(&auth->reconnect.seed) / RAND_MAX;
+   auth->reconnect.attempts++;
+   INF("Reconnecting in %.1f seconds", delay);
+   auth->reconnect.timer = ecore_timer_add(delay, (Ecore_Task_Cb)shotgun_reconnect_cb, auth);
+   ecore_event_add(SHOTGUN_EVENT_RECONNECT, auth, shotgun_fake_free, NULL);
+}
+
 static Eina_Bool
-disc(void *data __UNUSED__, int type __UNUSED__, Ecore_Con_Event_Server_Add *ev __UNUSED__)
+disc(Shotgun_Auth *auth, int type __UNUSED__, Ecore_Con_Event_Server_Del *ev)
 {
-   ecore_main_loop_quit();
-   INF("Disconnected");
+   if (auth != ecore_con_server_data_get(ev->server))
+     return ECORE_CALLBACK_PASS_ON;
+
+   ecore_con_server_del(ev->server);
+   if (auth->svr != ev->server) return ECORE_CALLBACK_RENEW;
+   auth->svr = NULL;
+   if (auth->tls.direct && (!auth->tls.failed) && (auth->state < SHOTGUN_STATE_SASL))
+     {  /* never got as far as features */
+        INF("Direct TLS failed, falling back to STARTTLS");
+        auth->tls.failed = EINA_TRUE;
+     }
+   if (shotgun_sm_lost(auth))
+     INF("Disconnected, will try to resume session %s", auth->sm.id);
+   else
+     {
+        INF("Disconnected");
+        /* nothing will answer these now */
+        shotgun_iq_requests_cancel(auth);
+     }
+   shotgun_reconnect(auth);
    return ECORE_CALLBACK_RENEW;
 }
 
 static Shotgun_Data_Type
-shotgun_data_tokenize(Shotgun_Auth *auth, Ecore_Con_Event_Server_Data *ev)
+shotgun_data_tokenize(const char *data)
 {
-   const char *data;
-   data = auth->buf ? eina_strbuf_string_get(auth->buf) : ev->data;
    if (data[0] != '<') return SHOTGUN_DATA_TYPE_UNKNOWN;
 
    switch (data[1])
@@ -42,104 +125,244 @@ shotgun_data_tokenize(Shotgun_Auth *auth, Ecore_Con_Event_Server_Data *ev)
    return SHOTGUN_DATA_TYPE_UNKNOWN;
 }
 
-static Eina_Bool
-shotgun_data_detect(Shotgun_Auth *auth, Ecore_Con_Event_Server_Data *ev)
+static void
+shotgun_data_dispatch(Shotgun_Auth *auth, char *data, size_t size)
+{
+   if (auth->state < SHOTGUN_STATE_CONNECTED)
+     {
+        shotgun_login(auth, data, size);
+        return;
+     }
+
+   switch (shotgun_data_tokenize(data))
+     {
+      case SHOTGUN_DATA_TYPE_MSG:
+        shotgun_message_feed(auth, data, size);
+        break;
+      case SHOTGUN_DATA_TYPE_IQ:
+        shotgun_iq_feed(auth, data, size);
+        break;
+      case SHOTGUN_DATA_TYPE_PRES:
+        shotgun_presence_feed(auth, data, size);
+        break;
+      default:
+        if (data[1] == '/')
+          INF("Server closed stream");
+        else if (!shotgun_sm_feed(auth, data, size))
+          ERR("UNPARSABLE TAG!");
+        return;
+     }
+   if (auth->sm.active) auth->sm.in++;
+}
+
+/* called for every '>' that closes an element tag */
+static void
+shotgun_data_tag_end(Shotgun_Auth *auth, char *data, size_t end)
 {
-   if (((char*)ev->data)[ev->size - 1] != '>')
+   size_t tag = auth->tok.tag, len = end + 1 - tag;
+
+   if (auth->tok.closing)
+     {
+        if (!auth->tok.depth) /* </stream:stream> */
+          shotgun_data_dispatch(auth, data + tag, len);
+        else if (!--auth->tok.depth)
+          shotgun_data_dispatch(auth, data + auth->tok.stanza, end + 1 - auth->tok.stanza);
+        return;
+     }
+   if (auth->tok.slash)
+     {  /* <empty/> stanza or child */
+        if (!auth->tok.depth)
+          shotgun_data_dispatch(auth, data + tag, len);
+        return;
+     }
+   if (!auth->tok.depth)
      {
-        if (!auth->buf)
+        /* the stream header is never closed, so it is not counted */
+        if ((len >= sizeof("<stream:stream")) && (!memcmp(data + tag, "<stream:stream", sizeof("<stream:stream") - 1)) &&
+            ((data[tag + sizeof("<stream:stream") - 1] == '>') || isspace(data[tag + sizeof("<stream:stream") - 1])))
           {
-             DBG("Creating event buffer");
-             auth->buf = eina_strbuf_new();
+             shotgun_data_dispatch(auth, data + tag, len);
+             return;
           }
-        DBG("Appending %i to buffer", ev->size);
-        eina_strbuf_append_length(auth->buf, ev->data, ev->size);
-        return EINA_FALSE;
+        auth->tok.stanza = tag;
      }
-   if (auth->buf)
+   auth->tok.depth++;
+}
+
+/* scans bytes from auth->tok.pos to size, dispatching each complete top-level element.
+ * returns the number of leading bytes which are no longer needed.
+ */
+static size_t
+shotgun_data_scan(Shotgun_Auth *auth, char *data, size_t size)
+{
+   size_t i;
+
+   for (i = auth->tok.pos; i < size; i++)
      {
-        size_t len;
-        const char *data, *tag;
-        char buf[24] = {0};
-
-        DBG("Appending %i to buffer", ev->size);
-        eina_strbuf_append_length(auth->buf, ev->data, ev->size);
-        len = eina_strbuf_length_get(auth->buf);
-        data = eina_strbuf_string_get(auth->buf);
-        tag = data + (len - 2);
-        while (tag[0] != '<') tag--;
-        tag += 2;
-        if (!memcmp(data + 1, tag, len - (tag - data) - 1)) /* open/end tags maybe match? */
+        char c = data[i];
+
+        switch (auth->tok.state)
           {
-             DBG("Releasing buffered event!");
-             return EINA_TRUE;
+           case SHOTGUN_TOKENIZER_STATE_TEXT:
+             if (c != '<') break;
+             auth->tok.tag = i;
+             auth->tok.state = SHOTGUN_TOKENIZER_STATE_LT;
+             break;
+           case SHOTGUN_TOKENIZER_STATE_LT:
+             if (c == '?')
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_PI;
+             else if (c == '!')
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_DECL;
+             else
+               {
+                  auth->tok.state = SHOTGUN_TOKENIZER_STATE_TAG;
+                  auth->tok.closing = (c == '/');
+                  auth->tok.slash = EINA_FALSE;
+               }
+             break;
+           case SHOTGUN_TOKENIZER_STATE_TAG:
+             if ((c == '\'') || (c == '"'))
+               {
+                  auth->tok.quote = c;
+                  auth->tok.state = SHOTGUN_TOKENIZER_STATE_QUOTE;
+               }
+             else if (c == '>')
+               {
+                  auth->tok.state = SHOTGUN_TOKENIZER_STATE_TEXT;
+                  shotgun_data_tag_end(auth, data, i);
+               }
+             auth->tok.slash = (c == '/');
+             break;
+           case SHOTGUN_TOKENIZER_STATE_QUOTE:
+             if (c == auth->tok.quote)
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_TAG;
+             break;
+           case SHOTGUN_TOKENIZER_STATE_PI:
+             if ((c == '>') && (data[i - 1] == '?'))
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_TEXT;
+             break;
+           case SHOTGUN_TOKENIZER_STATE_DECL:
+             if ((i - auth->tok.tag == 3) && (!memcmp(data + auth->tok.tag, "<!--", 4)))
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_COMMENT;
+             else if ((i - auth->tok.tag == 8) && (!memcmp(data + auth->tok.tag, "<![CDATA[", 9)))
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_CDATA;
+             else if (c == '>')
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_TEXT;
+             break;
+           case SHOTGUN_TOKENIZER_STATE_COMMENT:
+             if ((c == '>') && (i - auth->tok.tag > 5) && (data[i - 1] == '-') && (data[i - 2] == '-'))
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_TEXT;
+             break;
+           case SHOTGUN_TOKENIZER_STATE_CDATA:
+             if ((c == '>') && (i - auth->tok.tag > 10) && (data[i - 1] == ']') && (data[i - 2] == ']'))
+               auth->tok.state = SHOTGUN_TOKENIZER_STATE_TEXT;
+             break;
           }
-        memcpy(buf, data, sizeof(buf) - 1);
-        DBG("%s and %s do not match!", buf, tag);
-        return EINA_FALSE;
      }
-   return EINA_TRUE;
+   auth->tok.pos = size;
+   if (auth->tok.depth) return auth->tok.stanza;
+   if (auth->tok.state != SHOTGUN_TOKENIZER_STATE_TEXT) return auth->tok.tag;
+   return size;
+}
+
+/* shift the tokenizer offsets after the first used bytes have been dropped */
+static void
+shotgun_data_rebase(Shotgun_Auth *auth, size_t used)
+{
+   auth->tok.pos -= used;
+   if (auth->tok.state != SHOTGUN_TOKENIZER_STATE_TEXT)
+     auth->tok.tag -= used;
+   if (auth->tok.depth)
+     auth->tok.stanza -= used;
+}
+
+/* drop the first used bytes of the buffer, keeping the unfinished tail */
+static void
+shotgun_data_consume(Shotgun_Auth *auth, size_t used)
+{
+   if (!used) return;
+   if (used == eina_strbuf_length_get(auth->buf))
+     eina_strbuf_reset(auth->buf);
+   else
+     {
+        DBG("Keeping %zu bytes of unfinished data", eina_strbuf_length_get(auth->buf) - used);
+        eina_strbuf_remove(auth->buf, 0, used);
+     }
+   shotgun_data_rebase(auth, used);
 }
 
 static Eina_Bool
 data(Shotgun_Auth *auth, int type __UNUSED__, Ecore_Con_Event_Server_Data *ev)
 {
-   char *recv, *data, *p;
-   size_t size;
+   size_t used;
 
    if (auth != ecore_con_server_data_get(ev->server))
      return ECORE_CALLBACK_PASS_ON;
 
-   if (ev->size == 1)
-     {
-        DBG("Received carriage return");
-        return ECORE_CALLBACK_RENEW;
-     }
-   recv = alloca(ev->size + 1);
-   memcpy(recv, ev->data, ev->size);
-   for (p = recv + ev->size - 1; isspace(*p); p--)
-     *p = 0;
-   recv[ev->size] = 0;
-   DBG("Receiving %i bytes:\n%s", ev->size, recv);
+   DBG("Receiving %i bytes:\n%.*s", ev->size, ev->size, (char*)ev->data);
 
-   if (auth->state < SHOTGUN_STATE_CONNECTED)
+   if (!auth->buf) auth->buf = eina_strbuf_new();
+   if (!eina_strbuf_length_get(auth->buf))
      {
-        shotgun_login(auth, ev);
+        /* nothing pending: parse in place out of ecore_con's buffer
+         * and only keep whatever is left of an unfinished stanza
+         */
+        used = shotgun_data_scan(auth, ev->data, ev->size);
+        if (used < (size_t)ev->size)
+          {
+             DBG("Keeping %zu bytes of unfinished data", ev->size - used);
+             eina_strbuf_append_length(auth->buf, (char*)ev->data + used, ev->size - used);
+          }
+        shotgun_data_rebase(auth, used);
         return ECORE_CALLBACK_RENEW;
      }
 
-   if (!shotgun_data_detect(auth, ev))
-     return ECORE_CALLBACK_RENEW;
+   eina_strbuf_append_length(auth->buf, ev->data, ev->size);
+   used = shotgun_data_scan(auth, (char*)eina_strbuf_string_get(auth->buf), eina_strbuf_length_get(auth->buf));
+   shotgun_data_consume(auth, used);
+
+   return ECORE_CALLBACK_RENEW;
+}
+
+static void
+shotgun_flush_job(Shotgun_Auth *auth)
+{
+   auth->flush_job = NULL;
+   shotgun_flush(auth);
+}
 
-   data = auth->buf ? (char*)eina_strbuf_string_get(auth->buf) : (char*)ev->data;
-   size = auth->buf ? eina_strbuf_length_get(auth->buf) : (size_t)ev->size;
+/* stanzas written during one main loop iteration go out in a single send */
+void
+shotgun_queue(Shotgun_Auth *auth, const void *data, size_t size)
+{
+   Shotgun_Data_Type type;
 
-   switch (shotgun_data_tokenize(auth, ev))
+   type = shotgun_data_tokenize(data);
+   if (type != SHOTGUN_DATA_TYPE_UNKNOWN)
      {
-      case SHOTGUN_DATA_TYPE_MSG:
-        shotgun_message_feed(auth, data, size);
-        break;
-      case SHOTGUN_DATA_TYPE_IQ:
-        shotgun_iq_feed(auth, data, size);
-        break;
-      case SHOTGUN_DATA_TYPE_PRES:
-        shotgun_presence_feed(auth, data, size);
-        break;
-      default:
-        ERR("UNPARSABLE TAG!");
-        break;
+        if (auth->sm.enabled) shotgun_sm_sent(auth, data, size);
+        /* nothing may go out before the bind, anything may follow it */
+        if ((auth->state != SHOTGUN_STATE_CONNECTED) &&
+            (auth->sm.enabled || (auth->state < SHOTGUN_STATE_CONNECTING)))
+          {
+             /* held until the session is resumed */
+             if (!auth->sm.enabled) DBG("Not connected, dropping stanza");
+             return;
+          }
      }
-   if (auth->buf) eina_strbuf_free(auth->buf);
-   auth->buf = NULL;
-
-   return ECORE_CALLBACK_RENEW;
+   if (!auth->out) auth->out = eina_strbuf_new();
+   eina_strbuf_append_length(auth->out, data, size);
+   if (eina_strbuf_length_get(auth->out) >= SHOTGUN_FLUSH_SIZE)
+     shotgun_flush(auth);
+   else if (!auth->flush_job)
+     auth->flush_job = ecore_job_add((Ecore_Cb)shotgun_flush_job, auth);
 }
 
 static Eina_Bool
 error(void *d __UNUSED__, int type __UNUSED__, Ecore_Con_Event_Server_Error *ev)
 {
+   /* a SERVER_DEL follows, which takes care of reconnecting */
    ERR("%s", ev->error);
-   ecore_main_loop_quit();
    return ECORE_CALLBACK_RENEW;
 }
 
@@ -152,8 +375,10 @@ shotgun_init(void)
 
    /* real men don't accept failure as a possibility */
    shotgun_log_dom = eina_log_domain_register("shotgun", EINA_COLOR_RED);
+   xml_init();
 
    SHOTGUN_EVENT_CONNECT = ecore_event_type_new();
+   SHOTGUN_EVENT_RECONNECT = ecore_event_type_new();
    SHOTGUN_EVENT_MESSAGE = ecore_event_type_new();
    SHOTGUN_EVENT_PRESENCE = ecore_event_type_new();
    SHOTGUN_EVENT_IQ = ecore_event_type_new();
@@ -164,16 +389,36 @@ shotgun_init(void)
 Eina_Bool
 shotgun_gchat_connect(Shotgun_Auth *auth)
 {
-   ecore_event_handler_add(ECORE_CON_EVENT_SERVER_ADD, (Ecore_Event_Handler_Cb)shotgun_login_con, auth);
-   ecore_event_handler_add(ECORE_CON_EVENT_SERVER_DEL, (Ecore_Event_Handler_Cb)disc, NULL);
-   ecore_event_handler_add(ECORE_CON_EVENT_SERVER_DATA, (Ecore_Event_Handler_Cb)data, auth);
-   ecore_event_handler_add(ECORE_CON_EVENT_SERVER_ERROR, (Ecore_Event_Handler_Cb)error, NULL);
-   ecore_event_handler_add(ECORE_CON_EVENT_SERVER_UPGRADE, (Ecore_Event_Handler_Cb)shotgun_login_con, auth);
-   auth->svr = ecore_con_server_connect(ECORE_CON_REMOTE_NODELAY, "talk.google.com", 5222, auth);
+   EINA_SAFETY_ON_NULL_RETURN_VAL(auth, EINA_FALSE);
+
+   if (auth->svr || auth->reconnect.timer) return EINA_TRUE;
+   if (!auth->handlers[0])
+     {  /* once per account, however often it connects */
+        auth->handlers[0] = ecore_event_handler_add(ECORE_CON_EVENT_SERVER_ADD, (Ecore_Event_Handler_Cb)shotgun_login_con, auth);
+        auth->handlers[1] = ecore_event_handler_add(ECORE_CON_EVENT_SERVER_DEL, (Ecore_Event_Handler_Cb)disc, auth);
+        auth->handlers[2] = ecore_event_handler_add(ECORE_CON_EVENT_SERVER_DATA, (Ecore_Event_Handler_Cb)data, auth);
+        auth->handlers[3] = ecore_event_handler_add(ECORE_CON_EVENT_SERVER_ERROR, (Ecore_Event_Handler_Cb)error, NULL);
+        auth->handlers[4] = ecore_event_handler_add(ECORE_CON_EVENT_SERVER_UPGRADE, (Ecore_Event_Handler_Cb)shotgun_login_con, auth);
+     }
+   shotgun_connect(auth);
 
    return EINA_TRUE;
 }
 
+void
+shotgun_flush(Shotgun_Auth *auth)
+{
+   EINA_SAFETY_ON_NULL_RETURN(auth);
+
+   if (auth->flush_job) ecore_job_del(auth->flush_job);
+   auth->flush_job = NULL;
+   if ((!auth->out) || (!eina_strbuf_length_get(auth->out))) return;
+   shotgun_sm_flush(auth);
+   if (auth->svr)
+     ecore_con_server_send(auth->svr, eina_strbuf_string_get(auth->out), eina_strbuf_length_get(auth->out));
+   eina_strbuf_reset(auth->out);
+}
+
 Shotgun_Auth *
 shotgun_new(const char *username, const char *domain)
 {
@@ -195,6 +440,7 @@ shotgun_password_set(Shotgun_Auth *auth, const char *password)
    EINA_SAFETY_ON_NULL_RETURN(auth);
    EINA_SAFETY_ON_NULL_RETURN(password);
 
+   shotgun_sasl_forget(auth);
    auth->pass = password;
 }
 
@@ -202,5 +448,29 @@ void
 shotgun_password_del(Shotgun_Auth *auth)
 {
    EINA_SAFETY_ON_NULL_RETURN(auth);
+   shotgun_sasl_forget(auth);
    auth->pass = NULL;
 }
+
+void
+shotgun_direct_tls_set(Shotgun_Auth *auth, Eina_Bool direct)
+{
+   EINA_SAFETY_ON_NULL_RETURN(auth);
+
+   auth->tls.direct = !!direct;
+   auth->tls.failed = EINA_FALSE;
+}
+
+void
+shotgun_login_pipeline_set(Shotgun_Auth *auth, Eina_Bool pipeline)
+{
+   EINA_SAFETY_ON_NULL_RETURN(auth);
+   auth->pipeline = !!pipeline;
+}
+
+const char *
+shotgun_jid_get(Shotgun_Auth *auth)
+{
+   EINA_SAFETY_ON_NULL_RETURN_VAL(auth, NULL);
+   return auth->jid;
+}
@@ -5,6 +5,8 @@
 # define __UNUSED__ __attribute__((unused))
 #endif
 
+#include <stdint.h>
+#include <Ecore.h>
 #include <Ecore_Con.h>
 #include "Shotgun.h"
 
@@ -33,6 +35,19 @@ typedef enum
    SHOTGUN_DATA_TYPE_PRES
 } Shotgun_Data_Type;
 
+/* incremental stanza splitter states */
+typedef enum
+{
+   SHOTGUN_TOKENIZER_STATE_TEXT, /* between tags */
+   SHOTGUN_TOKENIZER_STATE_LT, /* just read '<' */
+   SHOTGUN_TOKENIZER_STATE_TAG, /* inside an element tag */
+   SHOTGUN_TOKENIZER_STATE_QUOTE, /* inside an attribute value */
+   SHOTGUN_TOKENIZER_STATE_PI, /* inside <? ?> */
+   SHOTGUN_TOKENIZER_STATE_DECL, /* just read <! */
+   SHOTGUN_TOKENIZER_STATE_COMMENT, /* inside <!-- --> */
+   SHOTGUN_TOKENIZER_STATE_CDATA /* inside <![CDATA[ ]]> */
+} Shotgun_Tokenizer_State;
+
 typedef enum
 {
    SHOTGUN_IQ_TYPE_GET,
@@ -41,6 +56,91 @@ typedef enum
    SHOTGUN_IQ_TYPE_ERROR
 } Shotgun_Iq_Type;
 
+/* rfc6120 error-type of an iq error, or why there was no answer at all */
+typedef enum
+{
+   SHOTGUN_IQ_ERROR_NONE,
+   SHOTGUN_IQ_ERROR_AUTH, /* retry after providing credentials */
+   SHOTGUN_IQ_ERROR_CANCEL, /* do not retry */
+   SHOTGUN_IQ_ERROR_CONTINUE, /* proceed, the condition was only a warning */
+   SHOTGUN_IQ_ERROR_MODIFY, /* retry after changing the data sent */
+   SHOTGUN_IQ_ERROR_WAIT, /* retry after waiting */
+   SHOTGUN_IQ_ERROR_TIMEOUT, /* no answer arrived in time */
+   SHOTGUN_IQ_ERROR_DISCONNECTED /* the session the iq was sent on is gone */
+} Shotgun_Iq_Error;
+
+/* seconds to wait for the answer to an iq */
+#define SHOTGUN_IQ_TIMEOUT 30.0
+
+/* called exactly once with the answer to a tracked iq (iq may be NULL).
+ * return EINA_TRUE to also emit iq as SHOTGUN_EVENT_IQ
+ */
+typedef Eina_Bool (*Shotgun_Iq_Cb)(void *data, Shotgun_Auth *auth, Shotgun_Event_Iq *iq, Shotgun_Iq_Error error);
+
+/* id and error-type of an incoming result or error */
+typedef struct
+{
+   char id[32];
+   Shotgun_Iq_Error error;
+} Shotgun_Iq_Reply;
+
+
+typedef struct
+{
+   uint32_t h[5];
+   uint64_t len;
+   unsigned char block[64];
+} Shotgun_Sha1;
+
+typedef struct
+{
+   uint32_t h[8];
+   uint64_t len;
+   unsigned char block[64];
+} Shotgun_Sha256;
+
+/* streaming base64 encoder state, zero it to start */
+typedef struct
+{
+   unsigned char in[3];
+   unsigned int n;
+} Shotgun_Base64;
+
+/* XEP-0198 nonzas */
+typedef enum
+{
+   SHOTGUN_SM_UNKNOWN,
+   SHOTGUN_SM_REQUEST, /* <r/> */
+   SHOTGUN_SM_ACK, /* <a/> */
+   SHOTGUN_SM_ENABLED,
+   SHOTGUN_SM_RESUMED,
+   SHOTGUN_SM_FAILED
+} Shotgun_Sm_Type;
+
+/* SASL mechanisms we can use, as bits of features.mechs */
+typedef enum
+{
+   SHOTGUN_SASL_MECH_PLAIN = (1 << 0),
+   SHOTGUN_SASL_MECH_SCRAM_SHA_1 = (1 << 1),
+   SHOTGUN_SASL_MECH_SCRAM_SHA_256 = (1 << 2)
+} Shotgun_Sasl_Mech;
+
+/* where a SCRAM exchange is at */
+typedef enum
+{
+   SHOTGUN_SASL_STEP_FIRST, /* client-first-message sent */
+   SHOTGUN_SASL_STEP_FINAL, /* client-final-message sent, the verifier is next */
+   SHOTGUN_SASL_STEP_VERIFIED /* a challenge had the verifier, only <success/> is left */
+} Shotgun_Sasl_Step;
+
+/* what the server said during SASL */
+typedef enum
+{
+   SHOTGUN_SASL_UNKNOWN,
+   SHOTGUN_SASL_CHALLENGE,
+   SHOTGUN_SASL_SUCCESS,
+   SHOTGUN_SASL_FAILURE
+} Shotgun_Sasl_Type;
 
 /* pre-formatted xml */
 typedef enum
@@ -62,14 +162,94 @@ struct Shotgun_Auth
 
    const char *pass; /* NOT ALLOCATED! */
 
-   Eina_Strbuf *buf;
+   struct
+   {  /* SCRAM state, see sasl.c */
+      Shotgun_Sasl_Mech mech; /* the one this login uses */
+      Shotgun_Sasl_Step step;
+      char *first; /* client-first-message-bare */
+      unsigned char signature[32]; /* the ServerSignature to expect */
+      struct
+      {  /* PBKDF2 output for the last salt and iteration count the server sent */
+         Shotgun_Sasl_Mech mech;
+         const char *salt; /* base64, as sent */
+         unsigned int iterations;
+         unsigned char key[32];
+      } salted;
+   } sasl;
+
+   Eina_Strbuf *buf; /* unfinished stanza data */
+   struct
+   {  /* all offsets are into buf */
+      Shotgun_Tokenizer_State state;
+      size_t pos; /* next byte to scan */
+      size_t tag; /* start of the current tag */
+      size_t stanza; /* start of the current top-level element */
+      unsigned int depth;
+      char quote;
+      Eina_Bool closing : 1;
+      Eina_Bool slash : 1;
+   } tok;
+   void *parse; /* reusable parse context, see xml.cpp */
+   Eina_Strbuf *xmlbuf; /* last serialized stanza */
+   Eina_Strbuf *out; /* queued outgoing stanzas */
+   Ecore_Job *flush_job;
+
+   unsigned int iq_id; /* last generated iq id */
+   Eina_Hash *iqs; /* iq id -> request awaiting an answer */
+   struct
+   {  /* vcard requests are windowed so a large roster can't flood the server */
+      Eina_Hash *jids; /* bare jids which are queued or pending */
+      Eina_List *queue; /* bare jids waiting for a free slot */
+      unsigned int pending;
+      unsigned int window; /* max pending requests */
+   } vcard;
+
+   struct
+   {  /* last known roster, see roster.c */
+      Eina_Hash *users; /* bare jid -> Shotgun_User */
+      const char *ver;
+   } roster;
+
+   struct
+   {  /* XEP-0198 stream management, see sm.c */
+      const char *id; /* session to resume after a drop, NULL if there is none */
+      unsigned int max; /* seconds the server keeps a dropped session, 0 if it didn't say */
+      double lost; /* when the connection dropped */
+      unsigned int in; /* stanzas received since <enabled/> */
+      unsigned int acked; /* stanzas the server has confirmed */
+      Eina_Strbuf *unacked; /* sent stanzas the server hasn't confirmed yet */
+      unsigned int *lens; /* length of each of them */
+      unsigned int count, alloc;
+      Eina_Bool enabled : 1; /* outgoing stanzas are counted */
+      Eina_Bool active : 1; /* incoming stanzas are counted */
+      Eina_Bool requested : 1; /* an <r/> is unanswered */
+      Eina_Bool resuming : 1;
+   } sm;
 
    Ecore_Con_Server *svr;
+   Ecore_Event_Handler *handlers[5];
+
+   struct
+   {  /* connection attempts after a drop, see shotgun_reconnect() */
+      Ecore_Timer *timer;
+      unsigned int attempts; /* since the last login */
+      unsigned int seed; /* for the jitter */
+   } reconnect;
+
+   struct
+   {  /* XEP-0368: TLS from the first byte, no STARTTLS round trips */
+      Eina_Bool direct : 1;
+      Eina_Bool failed : 1; /* the server didn't talk to us that way, use STARTTLS */
+   } tls;
+   Eina_Bool pipeline : 1; /* see shotgun_login_pipeline_set() */
 
    struct
    {  /* this serves no real purpose */
       Eina_Bool starttls : 1;
       Eina_Bool sasl : 1;
+      unsigned int mechs : 3; /* Shotgun_Sasl_Mech */
+      Eina_Bool rosterver : 1;
+      Eina_Bool sm : 1;
    } features;
    Shotgun_State state;
 };
@@ -79,11 +259,13 @@ extern int shotgun_log_dom;
 #ifdef __cplusplus
 extern "C" {
 #endif
+void shotgun_queue(Shotgun_Auth *auth, const void *data, size_t size);
+
 static inline void
-shotgun_write(Ecore_Con_Server *svr, const void *data, size_t size)
+shotgun_write(Shotgun_Auth *auth, const void *data, size_t size)
 {
-   DBG("Sending:\n%s", (char*)data);
-   ecore_con_server_send(svr, data, size);
+   DBG("Sending:\n%.*s", (int)size, (char*)data);
+   shotgun_queue(auth, data, size);
 }
 
 static inline void
@@ -94,15 +276,49 @@ void shotgun_message_feed(Shotgun_Auth *auth, char *data, size_t size);
 Shotgun_Event_Message *shotgun_message_new(Shotgun_Auth *auth);
 
 void shotgun_iq_feed(Shotgun_Auth *auth, char *data, size_t size);
+const char *shotgun_iq_request_add(Shotgun_Auth *auth, Shotgun_Iq_Cb cb, const void *data, double timeout);
+void shotgun_iq_requests_cancel(Shotgun_Auth *auth);
+void shotgun_iq_vcard_pump(Shotgun_Auth *auth);
+const char *shotgun_iq_error_str(Shotgun_Iq_Error error);
+
+Eina_Bool shotgun_sasl_start(Shotgun_Auth *auth);
+Shotgun_Sasl_Type shotgun_sasl_feed(Shotgun_Auth *auth, char *data, size_t size);
+void shotgun_sasl_forget(Shotgun_Auth *auth);
 
 Shotgun_Event_Presence *shotgun_presence_new(Shotgun_Auth *auth);
 void shotgun_presence_feed(Shotgun_Auth *auth, char *data, size_t size);
 
-char *shotgun_base64_encode(const unsigned char *string, double len, size_t *size);
-unsigned char *shotgun_base64_decode(const char *string, int len, size_t *size);
+size_t shotgun_base64_encode_buf(const unsigned char *in, size_t len, char *out);
+char *shotgun_base64_encode(const unsigned char *string, size_t len, size_t *size);
+void shotgun_base64_encode_append(Shotgun_Base64 *b64, Eina_Strbuf *buf, const void *data, size_t len);
+void shotgun_base64_encode_end(Shotgun_Base64 *b64, Eina_Strbuf *buf);
+ssize_t shotgun_base64_decode_buf(const char *in, size_t len, unsigned char *out);
+unsigned char *shotgun_base64_decode(const char *string, size_t len, size_t *size);
+void shotgun_sha1_init(Shotgun_Sha1 *ctx);
+void shotgun_sha1_update(Shotgun_Sha1 *ctx, const void *data, size_t size);
+void shotgun_sha1_final(Shotgun_Sha1 *ctx, unsigned char *digest);
+void shotgun_sha1_hex(const void *data, size_t size, char *hex);
+void shotgun_sha256_init(Shotgun_Sha256 *ctx);
+void shotgun_sha256_update(Shotgun_Sha256 *ctx, const void *data, size_t size);
+void shotgun_sha256_final(Shotgun_Sha256 *ctx, unsigned char *digest);
+Eina_Bool shotgun_file_write(const char *path, const void *data, size_t size);
+
+void shotgun_roster_load(Shotgun_Auth *auth);
+Shotgun_Event_Iq *shotgun_roster_cached(Shotgun_Auth *auth);
+Shotgun_Event_Iq *shotgun_roster_apply(Shotgun_Auth *auth, Eina_List *users, const char *ver, Eina_Bool full);
+
+Eina_Bool shotgun_avatar_load(Shotgun_User_Info *info, const char *sha1);
+void shotgun_avatar_save(Shotgun_User_Info *info);
 
 Eina_Bool shotgun_login_con(Shotgun_Auth *auth, int type, Ecore_Con_Event_Server_Add *ev);
-void shotgun_login(Shotgun_Auth *auth, Ecore_Con_Event_Server_Data *ev);
+void shotgun_login(Shotgun_Auth *auth, char *data, size_t size);
+
+void shotgun_sm_sent(Shotgun_Auth *auth, const void *data, size_t size);
+void shotgun_sm_flush(Shotgun_Auth *auth);
+Eina_Bool shotgun_sm_feed(Shotgun_Auth *auth, char *data, size_t size);
+void shotgun_sm_enable(Shotgun_Auth *auth);
+Eina_Bool shotgun_sm_resume(Shotgun_Auth *auth);
+Eina_Bool shotgun_sm_lost(Shotgun_Auth *auth);
 
 #ifdef __cplusplus
 }
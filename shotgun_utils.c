@@ -1,47 +1,303 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include "cencode.h"
-#include "cdecode.h"
+#include <string.h>
+#include <unistd.h>
+#include "shotgun_private.h"
 
-char *
-shotgun_base64_encode(const unsigned char *string, double len, size_t *size)
+/* SHA-1, rfc3174 */
+#define SHA1_ROL(X, N) (((X) << (N)) | ((X) >> (32 - (N))))
+
+static void
+shotgun_sha1_block(Shotgun_Sha1 *ctx, const unsigned char *block)
 {
-   base64_encodestate s;
-   char *ret = NULL;
-   int retlen[2];
+   uint32_t w[80], a, b, c, d, e, t;
+   int i;
 
-   if ((len < 1) || (!string)) return NULL;
+   for (i = 0; i < 16; i++)
+     w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+            ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+   for (; i < 80; i++)
+     w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
 
-   if (!(ret = malloc(sizeof(char) * ((((len + 2) - ((int)(len + 2) % 3)) / 3) * 4) + 4)))
-     return NULL;
-   base64_init_encodestate(&s);
-   retlen[0] = base64_encode_block((char*)string, len, ret, &s);
-   retlen[1] = base64_encode_blockend(ret + retlen[0], &s);
-   ret[retlen[0] + retlen[1]] = '\0';
-   if (ret[retlen[0] + retlen[1] - 1] == '\n')
+   a = ctx->h[0];
+   b = ctx->h[1];
+   c = ctx->h[2];
+   d = ctx->h[3];
+   e = ctx->h[4];
+   for (i = 0; i < 80; i++)
      {
-        ret[retlen[0] + retlen[1] - 1] = '\0';
-        *size = retlen[0] + retlen[1] - 2;
+        if (i < 20)
+          t = ((b & c) | (~b & d)) + 0x5A827999;
+        else if (i < 40)
+          t = (b ^ c ^ d) + 0x6ED9EBA1;
+        else if (i < 60)
+          t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+        else
+          t = (b ^ c ^ d) + 0xCA62C1D6;
+        t += SHA1_ROL(a, 5) + e + w[i];
+        e = d;
+        d = c;
+        c = SHA1_ROL(b, 30);
+        b = a;
+        a = t;
      }
-   else
-     *size = retlen[0] + retlen[1] - 1;
+   ctx->h[0] += a;
+   ctx->h[1] += b;
+   ctx->h[2] += c;
+   ctx->h[3] += d;
+   ctx->h[4] += e;
+}
+
+void
+shotgun_sha1_init(Shotgun_Sha1 *ctx)
+{
+   ctx->h[0] = 0x67452301;
+   ctx->h[1] = 0xEFCDAB89;
+   ctx->h[2] = 0x98BADCFE;
+   ctx->h[3] = 0x10325476;
+   ctx->h[4] = 0xC3D2E1F0;
+   ctx->len = 0;
+}
+
+void
+shotgun_sha1_update(Shotgun_Sha1 *ctx, const void *data, size_t size)
+{
+   const unsigned char *p = data;
+   size_t used = ctx->len % 64;
+
+   ctx->len += size;
+   if (used)
+     {
+        size_t n = 64 - used;
+
+        if (size < n)
+          {
+             memcpy(ctx->block + used, p, size);
+             return;
+          }
+        memcpy(ctx->block + used, p, n);
+        shotgun_sha1_block(ctx, ctx->block);
+        p += n;
+        size -= n;
+     }
+   for (; size >= 64; p += 64, size -= 64)
+     shotgun_sha1_block(ctx, p);
+   memcpy(ctx->block, p, size);
+}
+
+void
+shotgun_sha1_final(Shotgun_Sha1 *ctx, unsigned char *digest)
+{
+   unsigned char pad[72];
+   uint64_t bits = ctx->len * 8;
+   size_t n;
+   int i;
+
+   n = 64 - ((ctx->len + 8) % 64);
+   memset(pad, 0, sizeof(pad));
+   pad[0] = 0x80;
+   for (i = 0; i < 8; i++)
+     pad[n + i] = bits >> (56 - i * 8);
+   shotgun_sha1_update(ctx, pad, n + 8);
+   for (i = 0; i < 20; i++)
+     digest[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/* SHA-256, fips 180-4 */
+#define SHA256_ROR(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static const uint32_t sha256_k[64] =
+{
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void
+shotgun_sha256_block(Shotgun_Sha256 *ctx, const unsigned char *block)
+{
+   uint32_t w[64], s[8], t1, t2;
+   int i;
+
+   for (i = 0; i < 16; i++)
+     w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+            ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+   for (; i < 64; i++)
+     w[i] = w[i - 16] + w[i - 7] +
+            (SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+            (SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+   memcpy(s, ctx->h, sizeof(s));
+   for (i = 0; i < 64; i++)
+     {
+        t1 = s[7] + (SHA256_ROR(s[4], 6) ^ SHA256_ROR(s[4], 11) ^ SHA256_ROR(s[4], 25)) +
+             ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+        t2 = (SHA256_ROR(s[0], 2) ^ SHA256_ROR(s[0], 13) ^ SHA256_ROR(s[0], 22)) +
+             ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+     }
+   for (i = 0; i < 8; i++)
+     ctx->h[i] += s[i];
+}
+
+void
+shotgun_sha256_init(Shotgun_Sha256 *ctx)
+{
+   ctx->h[0] = 0x6a09e667;
+   ctx->h[1] = 0xbb67ae85;
+   ctx->h[2] = 0x3c6ef372;
+   ctx->h[3] = 0xa54ff53a;
+   ctx->h[4] = 0x510e527f;
+   ctx->h[5] = 0x9b05688c;
+   ctx->h[6] = 0x1f83d9ab;
+   ctx->h[7] = 0x5be0cd19;
+   ctx->len = 0;
+}
+
+void
+shotgun_sha256_update(Shotgun_Sha256 *ctx, const void *data, size_t size)
+{
+   const unsigned char *p = data;
+   size_t used = ctx->len % 64;
+
+   ctx->len += size;
+   if (used)
+     {
+        size_t n = 64 - used;
 
-   return ret;
+        if (size < n)
+          {
+             memcpy(ctx->block + used, p, size);
+             return;
+          }
+        memcpy(ctx->block + used, p, n);
+        shotgun_sha256_block(ctx, ctx->block);
+        p += n;
+        size -= n;
+     }
+   for (; size >= 64; p += 64, size -= 64)
+     shotgun_sha256_block(ctx, p);
+   memcpy(ctx->block, p, size);
 }
 
-unsigned char *
-shotgun_base64_decode(const char *string, int len, size_t *size)
+void
+shotgun_sha256_final(Shotgun_Sha256 *ctx, unsigned char *digest)
 {
-   base64_decodestate s;
-   unsigned char *ret = NULL;
-   int retlen;
+   unsigned char pad[72];
+   uint64_t bits = ctx->len * 8;
+   size_t n;
+   int i;
 
-   if ((len < 1) || (!string)) return NULL;
+   n = 64 - ((ctx->len + 8) % 64);
+   memset(pad, 0, sizeof(pad));
+   pad[0] = 0x80;
+   for (i = 0; i < 8; i++)
+     pad[n + i] = bits >> (56 - i * 8);
+   shotgun_sha256_update(ctx, pad, n + 8);
+   for (i = 0; i < 32; i++)
+     digest[i] = ctx->h[i / 4] >> (24 - (i % 4) * 8);
+}
 
-   if (!(ret = malloc(sizeof(char) * (int)((double)len / (double)(4 / 3)))))
-     return NULL;
-   base64_init_decodestate(&s);
-   retlen = base64_decode_block((char*)string, len, ret, &s);
-   *size = retlen;
+/* writes the lowercase hex SHA-1 of data to hex, which must hold 41 bytes */
+void
+shotgun_sha1_hex(const void *data, size_t size, char *hex)
+{
+   static const char digits[] = "0123456789abcdef";
+   Shotgun_Sha1 ctx;
+   unsigned char digest[20];
+   int i;
 
-   return ret;
+   shotgun_sha1_init(&ctx);
+   shotgun_sha1_update(&ctx, data, size);
+   shotgun_sha1_final(&ctx, digest);
+   for (i = 0; i < 20; i++)
+     {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 15];
+     }
+   hex[40] = 0;
+}
+
+/* builds $XDG_CACHE_HOME/shotgun/<sub> (or ~/.cache/shotgun/<sub>) into dir, creating it as needed */
+Eina_Bool
+shotgun_cache_dir(char *dir, size_t size, const char *sub)
+{
+   const char *base;
+   char *p;
+
+   base = getenv("XDG_CACHE_HOME");
+   if (base && base[0])
+     snprintf(dir, size, "%s/shotgun/%s", base, sub);
+   else
+     {
+        base = getenv("HOME");
+        if (!base) return EINA_FALSE;
+        snprintf(dir, size, "%s/.cache/shotgun/%s", base, sub);
+     }
+   /* mkdir -p */
+   for (p = strchr(dir + 1, '/'); ; p = strchr(p + 1, '/'))
+     {
+        if (p) *p = 0;
+        if (mkdir(dir, 0700) && (errno != EEXIST))
+          {
+             ERR("Could not create %s: %s", dir, strerror(errno));
+             dir[0] = 0;
+             return EINA_FALSE;
+          }
+        if (!p) break;
+        *p = '/';
+     }
+   return EINA_TRUE;
+}
+
+/* replaces path with data so that readers only ever see complete files */
+Eina_Bool
+shotgun_file_write(const char *path, const void *data, size_t size)
+{
+   char tmp[PATH_MAX];
+   const unsigned char *p;
+   ssize_t n;
+   int fd;
+
+   snprintf(tmp, sizeof(tmp), "%s.%u", path, (unsigned int)getpid());
+   fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   if (fd < 0)
+     {
+        ERR("Could not create %s: %s", tmp, strerror(errno));
+        return EINA_FALSE;
+     }
+   for (p = data; size; p += n, size -= n)
+     {
+        n = write(fd, p, size);
+        if (n > 0) continue;
+        if ((n < 0) && (errno == EINTR))
+          {
+             n = 0;
+             continue;
+          }
+        ERR("Could not write %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return EINA_FALSE;
+     }
+   close(fd);
+   if (rename(tmp, path))
+     {
+        ERR("Could not rename %s: %s", tmp, strerror(errno));
+        unlink(tmp);
+        return EINA_FALSE;
+     }
+   return EINA_TRUE;
 }
@@ -0,0 +1,205 @@
+#include <Ecore.h>
+#include "shotgun_private.h"
+#include "xml.h"
+
+/* XEP-0198 stream management.
+ * once <enable/> is sent, every outgoing stanza is kept in auth->sm.unacked
+ * until an <a/> from the server says it arrived, and every incoming one is
+ * counted so that <r/> can be answered. an <r/> goes out with every flush
+ * that leaves stanzas unconfirmed, unless one is still unanswered.
+ *
+ * if the server allows it, a dropped session is resumed on the next
+ * connection instead of binding a new one: the server replays what we
+ * missed and we resend whatever it never got, so neither side refetches
+ * roster or presence. stanzas written while the connection is down are
+ * held in the queue and go out with those.
+ */
+
+static void
+shotgun_sm_reset(Shotgun_Auth *auth)
+{
+   eina_stringshare_replace(&auth->sm.id, NULL);
+   if (auth->sm.unacked) eina_strbuf_reset(auth->sm.unacked);
+   auth->sm.count = 0;
+   auth->sm.in = auth->sm.acked = 0;
+   auth->sm.enabled = auth->sm.active = auth->sm.requested = auth->sm.resuming = EINA_FALSE;
+}
+
+/* forgets the stanzas up to h */
+static void
+shotgun_sm_ack(Shotgun_Auth *auth, unsigned int h)
+{
+   unsigned int n, i;
+   size_t len = 0;
+
+   n = h - auth->sm.acked;
+   if (n > auth->sm.count)
+     {
+        ERR("Server acked %u stanzas, only %u were sent", n, auth->sm.count);
+        n = auth->sm.count;
+     }
+   if (!n) return;
+   for (i = 0; i < n; i++)
+     len += auth->sm.lens[i];
+   eina_strbuf_remove(auth->sm.unacked, 0, len);
+   auth->sm.count -= n;
+   memmove(auth->sm.lens, auth->sm.lens + n, auth->sm.count * sizeof(unsigned int));
+   auth->sm.acked += n;
+   DBG("%u stanzas acked, %u left", n, auth->sm.count);
+}
+
+/* called by shotgun_queue() for every stanza while counting */
+void
+shotgun_sm_sent(Shotgun_Auth *auth, const void *data, size_t size)
+{
+   if (auth->sm.count == auth->sm.alloc)
+     {
+        unsigned int *lens;
+
+        lens = realloc(auth->sm.lens, (auth->sm.alloc + 16) * sizeof(unsigned int));
+        if (!lens) return;
+        auth->sm.lens = lens;
+        auth->sm.alloc += 16;
+     }
+   if (!auth->sm.unacked) auth->sm.unacked = eina_strbuf_new();
+   eina_strbuf_append_length(auth->sm.unacked, data, size);
+   auth->sm.lens[auth->sm.count++] = size;
+}
+
+/* called by shotgun_flush() with auth->out about to be sent */
+void
+shotgun_sm_flush(Shotgun_Auth *auth)
+{
+   if ((!auth->sm.enabled) || auth->sm.requested || (!auth->sm.count) ||
+       (auth->state != SHOTGUN_STATE_CONNECTED))
+     return;
+   eina_strbuf_append_length(auth->out, XML_SM_REQUEST, sizeof(XML_SM_REQUEST) - 1);
+   auth->sm.requested = EINA_TRUE;
+}
+
+/* starts counting on a freshly bound session. messages and presences a
+ * failed resume left unconfirmed are sent again as part of it; iqs are not,
+ * their requests were cancelled and whoever made them has asked again
+ */
+void
+shotgun_sm_enable(Shotgun_Auth *auth)
+{
+   Eina_Strbuf *old;
+   unsigned int *lens, count, i, n;
+   const char *p;
+
+   old = auth->sm.unacked;
+   lens = auth->sm.lens;
+   count = auth->sm.count;
+   auth->sm.unacked = NULL;
+   auth->sm.lens = NULL;
+   auth->sm.alloc = 0;
+   shotgun_sm_reset(auth);
+
+   if (auth->features.sm)
+     {
+        shotgun_write(auth, XML_SM_ENABLE, sizeof(XML_SM_ENABLE) - 1);
+        auth->sm.enabled = EINA_TRUE;
+     }
+   for (i = n = 0, p = old ? eina_strbuf_string_get(old) : NULL; i < count; p += lens[i++])
+     {
+        if (p[1] == 'i') continue;
+        shotgun_queue(auth, p, lens[i]);
+        n++;
+     }
+   if (n) INF("Resent %u stanzas", n);
+   if (old) eina_strbuf_free(old);
+   free(lens);
+}
+
+/* sends <resume/> in place of a bind if the last session can be resumed */
+Eina_Bool
+shotgun_sm_resume(Shotgun_Auth *auth)
+{
+   const char *xml;
+   size_t len;
+
+   if ((!auth->sm.id) || (!auth->features.sm)) goto bind;
+   if (auth->sm.max && (ecore_time_get() - auth->sm.lost > auth->sm.max))
+     {
+        INF("Session %s has expired", auth->sm.id);
+        eina_stringshare_replace(&auth->sm.id, NULL);
+        goto bind;
+     }
+   xml = xml_sm_resume_write(auth, &len);
+   shotgun_write(auth, xml, len);
+   auth->sm.resuming = EINA_TRUE;
+   return EINA_TRUE;
+bind:
+   /* the bind isn't part of the old session, shotgun_sm_enable() sorts out the rest */
+   auth->sm.enabled = EINA_FALSE;
+   return EINA_FALSE;
+}
+
+/* called when the connection drops, returns whether the session can be resumed */
+Eina_Bool
+shotgun_sm_lost(Shotgun_Auth *auth)
+{
+   /* not when a connection trying to resume it drops */
+   if (auth->state == SHOTGUN_STATE_CONNECTED) auth->sm.lost = ecore_time_get();
+   auth->sm.requested = auth->sm.resuming = EINA_FALSE;
+   return !!auth->sm.id;
+}
+
+/* handles a stream management nonza, returns EINA_FALSE if data isn't one */
+Eina_Bool
+shotgun_sm_feed(Shotgun_Auth *auth, char *data, size_t size)
+{
+   const char *xml;
+   unsigned int h = auth->sm.acked;
+   size_t len;
+
+   switch (xml_sm_read(auth, data, size, &h))
+     {
+      case SHOTGUN_SM_REQUEST:
+        if (!auth->sm.active) break;
+        xml = xml_sm_ack_write(auth, &len);
+        shotgun_queue(auth, xml, len);
+        break;
+      case SHOTGUN_SM_ACK:
+        if (!auth->sm.enabled) break;
+        shotgun_sm_ack(auth, h);
+        auth->sm.requested = EINA_FALSE;
+        break;
+      case SHOTGUN_SM_ENABLED:
+        INF("Stream management enabled%s%s", auth->sm.id ? ", session " : "", auth->sm.id ? auth->sm.id : "");
+        auth->sm.active = EINA_TRUE;
+        break;
+      case SHOTGUN_SM_RESUMED:
+        shotgun_sm_ack(auth, h);
+        INF("Session %s resumed, resending %u stanzas", auth->sm.id, auth->sm.count);
+        auth->sm.resuming = EINA_FALSE;
+        auth->sm.enabled = EINA_TRUE;
+        auth->reconnect.attempts = 0;
+        if (auth->sm.count)
+          {  /* already counted, so they go out as they are */
+             if (!auth->out) auth->out = eina_strbuf_new();
+             eina_strbuf_append_length(auth->out, eina_strbuf_string_get(auth->sm.unacked),
+                                       eina_strbuf_length_get(auth->sm.unacked));
+          }
+        auth->state = SHOTGUN_STATE_CONNECTED;
+        shotgun_iq_vcard_pump(auth);
+        shotgun_flush(auth);
+        break;
+      case SHOTGUN_SM_FAILED:
+        if (auth->sm.resuming)
+          {  /* keep what the old session never got for the new one */
+             INF("Could not resume session %s", auth->sm.id);
+             shotgun_sm_ack(auth, h);
+             eina_stringshare_replace(&auth->sm.id, NULL);
+             auth->sm.resuming = auth->sm.enabled = EINA_FALSE;
+             return EINA_TRUE;
+          }
+        WRN("Server refused stream management");
+        shotgun_sm_reset(auth);
+        break;
+      default:
+        return EINA_FALSE;
+     }
+   return EINA_TRUE;
+}
@@ -1,24 +1,171 @@
 #include "ui.h"
 
+/* each contact keeps its last CHAT_HISTORY_SIZE messages.
+ * a chat window only ever shows the last CHAT_VIEW_TAIL of them, and is
+ * rebuilt from the ring once it has grown to CHAT_VIEW_MAX
+ */
+#define CHAT_HISTORY_SIZE 512
+#define CHAT_VIEW_TAIL 100
+#define CHAT_VIEW_MAX (CHAT_VIEW_TAIL * 2)
+/* "/search <words>" in a chat window lists this many logged messages */
+#define CHAT_SEARCH_RESULTS 20
+
+static void
+_chat_message_format(Eina_Strbuf *buf, const Chat_Message *m)
+{
+   char timebuf[11];
+   char *s;
+
+   strftime(timebuf, sizeof(timebuf), "[%H:%M:%S]", localtime(&m->time));
+   s = elm_entry_utf8_to_markup(m->msg);
+   eina_strbuf_append_printf(buf, "<color=#%s>%s <b>%s:</b></color> %s<ps>",
+                             m->me ? "00FF01" : "0001FF", timebuf, m->from, s);
+   free(s);
+}
+
+static void
+_chat_history_show(Contact *c)
+{
+   Eina_Strbuf *buf;
+   unsigned int i, n;
+
+   n = (c->history.count < CHAT_VIEW_TAIL) ? c->history.count : CHAT_VIEW_TAIL;
+   buf = eina_strbuf_new();
+   for (i = c->history.count - n; i < c->history.count; i++)
+     _chat_message_format(buf, &c->history.msgs[(c->history.start + i) % CHAT_HISTORY_SIZE]);
+   elm_entry_entry_set(c->chat_buffer, eina_strbuf_string_get(buf));
+   elm_entry_cursor_end_set(c->chat_buffer);
+   eina_strbuf_free(buf);
+   c->history.shown = n;
+   c->history.oldest = n ? c->history.msgs[(c->history.start + c->history.count - n) % CHAT_HISTORY_SIZE].time : 0;
+}
+
+static Chat_Message *
+_chat_history_push(Contact *c, const char *from, const char *msg, Eina_Bool me, time_t t)
+{
+   Chat_Message *m;
+
+   if (c->history.count == CHAT_HISTORY_SIZE)
+     {  /* forget the oldest */
+        m = &c->history.msgs[c->history.start];
+        eina_stringshare_del(m->from);
+        free(m->msg);
+        c->history.start = (c->history.start + 1) % CHAT_HISTORY_SIZE;
+        c->history.count--;
+     }
+   m = &c->history.msgs[(c->history.start + c->history.count++) % CHAT_HISTORY_SIZE];
+   m->time = t;
+   m->from = eina_stringshare_add(from);
+   m->msg = strdup(msg);
+   m->me = !!me;
+   return m;
+}
+
+static const char *
+_chat_history_from(Contact *c, Eina_Bool me)
+{
+   const char *from;
+
+   if (me) return "me";
+   from = (c->info && c->info->full_name) ? c->info->full_name : c->base->name;
+   return from ? from : c->base->jid;
+}
+
+static void
+_chat_history_log_cb(Contact *c, const char *msg, Eina_Bool me, time_t t)
+{
+   _chat_history_push(c, _chat_history_from(c, me), msg, me, t);
+}
+
+typedef struct
+{
+   Contact *c;
+   Eina_Strbuf *buf;
+} Chat_Page;
+
+static void
+_chat_page_log_cb(Chat_Page *p, const char *msg, Eina_Bool me, time_t t)
+{
+   Chat_Message m;
+
+   if (!eina_strbuf_length_get(p->buf)) p->c->history.oldest = t;
+   m.time = t;
+   m.from = _chat_history_from(p->c, me);
+   m.msg = (char*)msg;
+   m.me = !!me;
+   _chat_message_format(p->buf, &m);
+}
+
+/* puts the page of the log before the oldest message shown in front of it */
+static void
+_chat_history_older(Contact *c)
+{
+   Chat_Page p;
+   unsigned int n;
+
+   if ((!c->chat_buffer) || (!c->history.oldest)) return;
+   p.c = c;
+   p.buf = eina_strbuf_new();
+   n = chat_log_page(c->list->log, c->base->jid, c->history.oldest, CHAT_VIEW_TAIL, (Chat_Log_Cb)_chat_page_log_cb, &p);
+   if (n)
+     {
+        eina_strbuf_append(p.buf, elm_entry_entry_get(c->chat_buffer));
+        elm_entry_entry_set(c->chat_buffer, eina_strbuf_string_get(p.buf));
+        elm_entry_cursor_begin_set(c->chat_buffer);
+        c->history.shown += n;
+     }
+   eina_strbuf_free(p.buf);
+}
+
+/* the ring starts out with the end of the logged conversation */
+static void
+_chat_history_init(Contact *c)
+{
+   if (c->history.msgs) return;
+   c->history.msgs = calloc(CHAT_HISTORY_SIZE, sizeof(Chat_Message));
+   chat_log_page(c->list->log, c->base->jid, 0, CHAT_VIEW_TAIL, (Chat_Log_Cb)_chat_history_log_cb, c);
+}
+
 void
 chat_message_insert(Contact *c, const char *from, const char *msg, Eina_Bool me)
 {
-   size_t len;
-   char timebuf[11];
-   char *buf, *s;
-   Evas_Object *e = c->chat_buffer;
+   Chat_Message *m;
+   Eina_Strbuf *buf;
 
-   len = strftime(timebuf, sizeof(timebuf), "[%H:%M:%S]",
-            localtime((time_t[]){ time(NULL) }));
+   _chat_history_init(c);
+   m = _chat_history_push(c, from, msg, me, time(NULL));
+   chat_log_append(c->list->log, c->base->jid, msg, me, m->time);
 
-   s = elm_entry_utf8_to_markup(msg);
-   len += strlen(from) + strlen(s) + sizeof("<color=#%s>%s <b>%s:</b></color> %s<ps>") + 5;
-   buf = alloca(len);
-   snprintf(buf, len, "<color=#%s>%s <b>%s:</b></color> %s<ps>", me ? "00FF01" : "0001FF", timebuf, from, s);
-   free(s);
+   if (!c->chat_buffer) return;
+   if (c->history.shown >= CHAT_VIEW_MAX)
+     {
+        _chat_history_show(c);
+        return;
+     }
+   if (!c->history.shown) c->history.oldest = m->time;
+   buf = eina_strbuf_new();
+   _chat_message_format(buf, m);
+   elm_entry_entry_append(c->chat_buffer, eina_strbuf_string_get(buf));
+   elm_entry_cursor_end_set(c->chat_buffer);
+   eina_strbuf_free(buf);
+   c->history.shown++;
+}
+
+void
+chat_history_free(Contact *c)
+{
+   unsigned int i;
+
+   if (!c->history.msgs) return;
+   for (i = 0; i < c->history.count; i++)
+     {
+        Chat_Message *m = &c->history.msgs[(c->history.start + i) % CHAT_HISTORY_SIZE];
 
-   elm_entry_entry_append(e, buf);
-   elm_entry_cursor_end_set(e);
+        eina_stringshare_del(m->from);
+        free(m->msg);
+     }
+   free(c->history.msgs);
+   memset(&c->history, 0, sizeof(c->history));
 }
 
 void
@@ -36,6 +183,37 @@ chat_message_status(Contact *c, Shotgun_Event_Message *msg)
      }
 }
 
+static void
+_chat_search_result_cb(Eina_Strbuf *buf, const char *jid, const char *msg, Eina_Bool me, time_t t)
+{
+   char timebuf[19];
+   char *s;
+
+   strftime(timebuf, sizeof(timebuf), "[%Y-%m-%d %H:%M]", localtime(&t));
+   s = elm_entry_utf8_to_markup(msg);
+   eina_strbuf_append_printf(buf, "<color=#%s>%s <b>%s:</b></color> %s<ps>",
+                             me ? "00FF01" : "0001FF", timebuf, me ? "me" : jid, s);
+   free(s);
+}
+
+/* shows the logged messages matching query in the window, without sending */
+static void
+_chat_search_show(Contact *c, const char *query)
+{
+   Eina_Strbuf *buf;
+   char *s;
+
+   buf = eina_strbuf_new();
+   s = elm_entry_utf8_to_markup(query);
+   eina_strbuf_append_printf(buf, "<b>Search: %s</b><ps>", s);
+   free(s);
+   if (!chat_log_search(c->list->log, query, CHAT_SEARCH_RESULTS, (Chat_Log_Search_Cb)_chat_search_result_cb, buf))
+     eina_strbuf_append(buf, "No matches<ps>");
+   elm_entry_entry_append(c->chat_buffer, eina_strbuf_string_get(buf));
+   elm_entry_cursor_end_set(c->chat_buffer);
+   eina_strbuf_free(buf);
+}
+
 static void
 _chat_window_send_cb(void *data, Evas_Object *obj, void *ev __UNUSED__)
 {
@@ -44,8 +222,13 @@ _chat_window_send_cb(void *data, Evas_Object *obj, void *ev __UNUSED__)
 
    s = elm_entry_markup_to_utf8(elm_entry_entry_get(obj));
 
-   shotgun_message_send(c->base->account, c->cur->jid, s, 0);
-   chat_message_insert(c, "me", s, EINA_TRUE);
+   if (!strncmp(s, "/search ", sizeof("/search ") - 1))
+     _chat_search_show(c, s + sizeof("/search ") - 1);
+   else
+     {
+        shotgun_message_send(c->base->account, c->cur->jid, s, 0);
+        chat_message_insert(c, "me", s, EINA_TRUE);
+     }
    elm_entry_entry_set(obj, "");
 
    free(s);
@@ -60,16 +243,18 @@ _chat_window_close_cb(void *data, Evas_Object *obj __UNUSED__, const char *ev __
    INF("Closing window for %s", elm_win_title_get(data));
    cl = evas_object_data_get(data, "list");
    c = evas_object_data_get(data, "contact");
-   eina_stringshare_replace(&c->last_conv, elm_entry_entry_get(c->chat_buffer));
    c->chat_window = NULL;
    c->chat_buffer = NULL;
    c->chat_input = NULL;
    c->status_line = NULL;
+   c->history.shown = 0;
+   c->history.oldest = 0;
+   chat_image_window_cancel(cl, data);
    eina_hash_del_by_data(cl->user_convs, data);
 }
 
 static void
-_chat_conv_filter(Contact_List *cl, Evas_Object *obj __UNUSED__, char **str)
+_chat_conv_filter(Contact_List *cl __UNUSED__, Evas_Object *obj __UNUSED__, char **str)
 {
    char *http;
    const char *start, *end;
@@ -120,7 +305,6 @@ _chat_conv_filter(Contact_List *cl, Evas_Object *obj __UNUSED__, char **str)
                   eina_strbuf_free(buf);
                   buf = NULL;
                }
-             char_image_add(cl, strndupa(http, len));
              //DBG("ANCHOR: ");
              //DBG(fmt, http);
              break;
@@ -148,7 +332,6 @@ _chat_conv_filter(Contact_List *cl, Evas_Object *obj __UNUSED__, char **str)
              eina_strbuf_free(buf);
              return;
           }
-        char_image_add(cl, strndupa(http, len));
              //DBG("ANCHOR: ");
              //DBG(fmt, http);
         http = strstr(start, "http");
@@ -165,6 +348,8 @@ _chat_window_key(Evas_Object *win, Evas *e __UNUSED__, Evas_Object *obj __UNUSED
    DBG("%s", ev->keyname);
    if (!strcmp(ev->keyname, "Escape"))
      evas_object_smart_callback_call(win, "delete,request", NULL);
+   else if (!strcmp(ev->keyname, "Prior")) /* page up: older messages */
+     _chat_history_older(evas_object_data_get(win, "contact"));
 }
 
 void
@@ -183,6 +368,8 @@ chat_window_new(Contact *c)
    evas_object_smart_callback_add(win, "delete,request", (Evas_Smart_Cb)_chat_window_close_cb, win);
    evas_object_event_callback_add(win, EVAS_CALLBACK_KEY_DOWN, (Evas_Object_Event_Cb)_chat_window_key, win);
    1 | evas_object_key_grab(win, "Escape", 0, 0, 1); /* worst warn_unused ever. */
+   if (!evas_object_key_grab(win, "Prior", 0, 0, 1))
+     WRN("Could not grab Page Up, older messages can't be paged in");
    evas_object_resize(win, 450, 320);
    evas_object_show(win);
 
@@ -253,7 +440,8 @@ chat_window_new(Contact *c)
    c->status_line = status;
    if (c->description)
      elm_entry_entry_append(status, c->description);
-   if (c->last_conv)
-     elm_entry_entry_set(convo, c->last_conv);
+   _chat_history_init(c);
+   if (c->history.count)
+     _chat_history_show(c);
    elm_win_activate(win);
 }
@@ -1,25 +1,123 @@
+#include <limits.h>
+#include <unistd.h>
 #include "ui.h"
 //#ifdef HAVE_ECORE_X
 # include <Ecore_X.h>
 //#endif
 
 
+/* images linked in chats are fetched when their anchor is first hovered,
+ * at most IMAGE_FETCH_MAX at a time with the latest hovered one going first.
+ * fetched images are kept in memory up to IMAGE_CACHE_SIZE bytes, after which
+ * the least recently shown ones are spilled to $XDG_CACHE_HOME/shotgun/images
+ * for the rest of the session, or forgotten if that isn't possible.
+ */
+#define IMAGE_CACHE_SIZE (16 * 1024 * 1024)
+#define IMAGE_MAX_SIZE (4 * 1024 * 1024)
+#define IMAGE_FETCH_MAX 3
+
+static char image_dir[PATH_MAX];
+static unsigned int image_serial;
+
+static void
+_chat_image_spill(Image *i)
+{
+   char path[PATH_MAX];
+   FILE *f;
+
+   if ((!image_dir[0]) && (!shotgun_cache_dir(image_dir, sizeof(image_dir), "images"))) return;
+   snprintf(path, sizeof(path), "%s/%d-%u", image_dir, getpid(), image_serial++);
+   f = fopen(path, "wb");
+   if (!f) return;
+   if ((fwrite(i->data, 1, i->len, f) != i->len) | fclose(f))
+     {
+        unlink(path);
+        return;
+     }
+   i->spill = strdup(path);
+   DBG("Spilled %zu bytes of %s to %s", i->len, i->addr, path);
+}
+
+/* drops the least recently shown images until the cache fits */
+static void
+_chat_image_trim(Contact_List *cl)
+{
+   while ((cl->images_size > IMAGE_CACHE_SIZE) && cl->images_lru)
+     {
+        Image *i = EINA_INLIST_CONTAINER_GET(cl->images_lru, Image);
+
+        cl->images_lru = eina_inlist_remove(cl->images_lru, EINA_INLIST_GET(i));
+        cl->images_size -= i->len;
+        _chat_image_spill(i);
+        free(i->data);
+        i->data = NULL;
+        i->len = i->alloc = 0;
+        if (!i->spill) eina_hash_del_by_key(cl->images, i->addr);
+     }
+}
+
+static void
+_chat_image_progress_update(Image *i)
+{
+   char buf[64];
+
+   if (!i->progress) return;
+   if (i->total)
+     snprintf(buf, sizeof(buf), "Loading image... %zu%%", i->len * 100 / i->total);
+   else if (i->len)
+     snprintf(buf, sizeof(buf), "Loading image... %zu KiB", i->len / 1024);
+   else
+     snprintf(buf, sizeof(buf), "Loading image...");
+   elm_object_text_set(i->progress, buf);
+}
+
+static void
+_chat_image_progress_del(Image *i, Evas *e __UNUSED__, Evas_Object *obj, void *ev __UNUSED__)
+{
+   if (i->progress == obj) i->progress = NULL;
+}
+
+static Evas_Object *_chat_conv_image_provider(Image *i, Evas_Object *obj, Evas_Object *tt);
+
+/* swaps the placeholder for whatever i has become, if it is still shown */
+static void
+_chat_image_tooltip_refresh(Image *i, Image *show)
+{
+   if (!i->progress) return;
+   evas_object_event_callback_del_full(i->progress, EVAS_CALLBACK_DEL,
+                                       (Evas_Object_Event_Cb)_chat_image_progress_del, i);
+   i->progress = NULL;
+   elm_object_tooltip_content_cb_set(i->anchor, (Elm_Tooltip_Content_Cb)_chat_conv_image_provider, show, NULL);
+}
+
 static Evas_Object *
 _chat_conv_image_provider(Image *i, Evas_Object *obj, Evas_Object *tt)
 {
    Evas_Object *ret, *win = elm_object_top_widget_get(obj);
    int w, h, cw, ch;
    DBG("(i=%p,win=%p)", i, win);
-   if ((!i) || (!i->buf)) goto error;
+   if (i && i->url)
+     {
+        ret = elm_label_add(tt);
+        if (i->progress)
+          evas_object_event_callback_del_full(i->progress, EVAS_CALLBACK_DEL,
+                                              (Evas_Object_Event_Cb)_chat_image_progress_del, i);
+        i->progress = ret;
+        evas_object_event_callback_add(ret, EVAS_CALLBACK_DEL,
+                                       (Evas_Object_Event_Cb)_chat_image_progress_del, i);
+        _chat_image_progress_update(i);
+        return ret;
+     }
+   if ((!i) || ((!i->data) && (!i->spill))) goto error;
 
    ret = elm_icon_add(tt);
-   if (!elm_icon_memfile_set(ret, eina_binbuf_string_get(i->buf), eina_binbuf_length_get(i->buf), NULL, NULL))
+   if (i->data)
      {
-        /* an unloadable image is a useless image! */
-        eina_hash_del_by_key(i->cl->images, ecore_con_url_url_get(i->url));
-        evas_object_del(ret);
-        goto error;
+        if (!elm_icon_memfile_set(ret, i->data, i->len, NULL, NULL))
+          goto unloadable;
      }
+   else if (!elm_icon_file_set(ret, i->spill, NULL))
+     goto unloadable;
 
 //#ifdef HAVE_ECORE_X
    Ecore_X_Window xwin;
@@ -45,6 +143,10 @@ _chat_conv_image_provider(Image *i, Evas_Object *obj, Evas_Object *tt)
       if (sc) elm_object_scale_set(ret, sc);
    }
    return ret;
+unloadable:
+   /* an unloadable image is a useless image! */
+   eina_hash_del_by_key(i->cl->images, i->addr);
+   evas_object_del(ret);
 error:
    ret = elm_bg_add(tt);
    elm_bg_color_set(ret, 0, 0, 0);
@@ -60,7 +162,10 @@ chat_conv_image_show(Evas_Object *convo, Evas_Object *obj, Elm_Entry_Anchor_Info
    Image *i = NULL;
    Contact *c = evas_object_data_get(win, "contact");
 
-   if (c) i = eina_hash_find(c->list->images, ev->name);
+   if (c) i = char_image_add(c->list, ev->name, win);
+   if (i && i->done && i->data) /* spilled ones aren't in the lru */
+     c->list->images_lru = eina_inlist_demote(c->list->images_lru, EINA_INLIST_GET(i));
+   if (i) i->anchor = convo;
    elm_object_tooltip_content_cb_set(convo, (Elm_Tooltip_Content_Cb)_chat_conv_image_provider, i, NULL);
    elm_tooltip_size_restrict_disable(obj, EINA_TRUE);
    elm_object_tooltip_style_set(obj, "transparent");
@@ -75,28 +180,192 @@ chat_conv_image_hide(Evas_Object *convo __UNUSED__, Evas_Object *obj, Elm_Entry_
    DBG("anchor out: '%s' (%i, %i)", ev->name, ev->x, ev->y);
 }
 
-void
-char_image_add(Contact_List *cl, const char *url)
+static void
+_chat_image_fetch_next(Contact_List *cl)
+{
+   while (cl->images_queue && (cl->images_fetching < IMAGE_FETCH_MAX))
+     {
+        Image *i = eina_list_data_get(cl->images_queue);
+
+        cl->images_queue = eina_list_remove_list(cl->images_queue, cl->images_queue);
+        if (!ecore_con_url_get(i->url))
+          {
+             eina_hash_del_by_key(cl->images, i->addr);
+             continue;
+          }
+        DBG("Fetching %s", i->addr);
+        i->fetching = EINA_TRUE;
+        cl->images_fetching++;
+     }
+}
+
+/* lets go of i's transfer, if any.
+ * a running one may still have events queued which will find no image
+ * on it, so its url is only freed once the main loop gets back to jobs
+ */
+static void
+_chat_image_url_release(Image *i)
+{
+   if (!i->url) return;
+   ecore_con_url_data_set(i->url, NULL);
+   if (i->fetching)
+     {
+        ecore_job_add((Ecore_Cb)ecore_con_url_free, i->url);
+        i->fetching = EINA_FALSE;
+        i->cl->images_fetching--;
+     }
+   else
+     {
+        i->cl->images_queue = eina_list_remove(i->cl->images_queue, i);
+        ecore_con_url_free(i->url);
+     }
+   i->url = NULL;
+   _chat_image_fetch_next(i->cl);
+}
+
+/* stops fetching i for good, so hovering it again won't start over */
+static void
+_chat_image_reject(Image *i)
+{
+   _chat_image_url_release(i);
+   free(i->data);
+   i->data = NULL;
+   i->len = i->alloc = 0;
+   i->rejected = EINA_TRUE;
+   _chat_image_tooltip_refresh(i, i);
+}
+
+/* decides from the headers whether i is worth buffering.
+ * redirects stack their headers up, so only the last response counts
+ */
+static Eina_Bool
+_chat_image_headers_check(Image *i)
+{
+   const Eina_List *l;
+   const char *h, *type = NULL;
+   unsigned long len = 0;
+
+   EINA_LIST_FOREACH(ecore_con_url_response_headers_get(i->url), l, h)
+     {
+        if (!strncmp(h, "HTTP/", 5))
+          {
+             type = NULL;
+             len = 0;
+          }
+        else if (!strncasecmp(h, "Content-Length:", sizeof("Content-Length:") - 1))
+          len = strtoul(h + sizeof("Content-Length:") - 1, NULL, 10);
+        else if (!strncasecmp(h, "Content-Type:", sizeof("Content-Type:") - 1))
+          for (type = h + sizeof("Content-Type:") - 1; *type == ' '; type++);
+     }
+   if (type && strncasecmp(type, "image/", 6))
+     {
+        INF("Not fetching %s, it is not an image", i->addr);
+        return EINA_FALSE;
+     }
+   if (len > IMAGE_MAX_SIZE)
+     {
+        INF("Not fetching %s, it is %lu bytes", i->addr, len);
+        return EINA_FALSE;
+     }
+   /* the whole body goes in one allocation when its size is known */
+   i->total = len;
+   if (len)
+     {
+        i->data = malloc(len);
+        if (i->data) i->alloc = len;
+     }
+   return EINA_TRUE;
+}
+
+/* returns the image at url, queueing it for fetching in front of any other
+ * waiting ones if it isn't there yet. win is the window asking for it.
+ */
+Image *
+char_image_add(Contact_List *cl, const char *url, Evas_Object *win)
 {
    Image *i;
 
+   if (strncmp(url, "http", 4)) return NULL;
    i = eina_hash_find(cl->images, url);
-   if (i) return;
+   if (i)
+     {
+        if (i->url)
+          {
+             i->win = win;
+             if ((!i->fetching) && (eina_list_data_get(cl->images_queue) != i))
+               cl->images_queue = eina_list_promote_list(cl->images_queue, eina_list_data_find_list(cl->images_queue, i));
+          }
+        return i;
+     }
    i = calloc(1, sizeof(Image));
    i->url = ecore_con_url_new(url);
+   if (!i->url)
+     {
+        free(i);
+        return NULL;
+     }
    ecore_con_url_data_set(i->url, i);
+   i->addr = eina_stringshare_add(url);
    i->cl = cl;
-
-   ecore_con_url_get(i->url);
+   i->win = win;
    eina_hash_add(cl->images, url, i);
+
+   cl->images_queue = eina_list_prepend(cl->images_queue, i);
+   _chat_image_fetch_next(cl);
+   return i;
+}
+
+typedef struct
+{
+   Evas_Object *win;
+   Eina_List *addrs;
+} Image_Cancel;
+
+static Eina_Bool
+_chat_image_window_cancel_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Image *i, Image_Cancel *cancel)
+{
+   if (i->url && (i->win == cancel->win))
+     cancel->addrs = eina_list_append(cancel->addrs, eina_stringshare_ref(i->addr));
+   return EINA_TRUE;
+}
+
+/* drops the transfers a closing window asked for */
+void
+chat_image_window_cancel(Contact_List *cl, Evas_Object *win)
+{
+   Image_Cancel cancel = { win, NULL };
+   const char *addr;
+
+   eina_hash_foreach(cl->images, (Eina_Hash_Foreach)_chat_image_window_cancel_cb, &cancel);
+   EINA_LIST_FREE(cancel.addrs, addr)
+     {
+        DBG("Cancelling %s", addr);
+        eina_hash_del_by_key(cl->images, addr);
+        eina_stringshare_del(addr);
+     }
 }
 
 void
 chat_image_free(Image *i)
 {
    if (!i) return;
-   if (i->url) ecore_con_url_free(i->url);
-   if (i->buf) eina_binbuf_free(i->buf);
+   _chat_image_tooltip_refresh(i, NULL);
+   _chat_image_url_release(i);
+   if (i->data)
+     {
+        if (i->done)
+          {
+             i->cl->images_lru = eina_inlist_remove(i->cl->images_lru, EINA_INLIST_GET(i));
+             i->cl->images_size -= i->len;
+          }
+        free(i->data);
+     }
+   if (i->spill)
+     {
+        unlink(i->spill);
+        free(i->spill);
+     }
+   eina_stringshare_del(i->addr);
    free(i);
 }
 
@@ -105,9 +374,39 @@ chat_image_data(void *d __UNUSED__, int type __UNUSED__, Ecore_Con_Event_Url_Dat
 {
    Image *i = ecore_con_url_data_get(ev->url_con);
 
+   if (!i) return ECORE_CALLBACK_RENEW;
    //DBG("Received %i bytes of image: %s", ev->size, ecore_con_url_url_get(ev->url_con));
-   if (!i->buf) i->buf = eina_binbuf_new();
-   eina_binbuf_append_length(i->buf, &ev->data[0], ev->size);
+   if ((!i->len) && (!i->alloc) && (!_chat_image_headers_check(i)))
+     {
+        _chat_image_reject(i);
+        return ECORE_CALLBACK_RENEW;
+     }
+   if (i->len + ev->size > IMAGE_MAX_SIZE)
+     {  /* lying or missing Content-Length */
+        INF("Not keeping %s, it is larger than %d bytes", i->addr, IMAGE_MAX_SIZE);
+        _chat_image_reject(i);
+        return ECORE_CALLBACK_RENEW;
+     }
+   if (i->len + ev->size > i->alloc)
+     {  /* no (or a wrong) Content-Length, so grow geometrically */
+        size_t alloc = i->alloc ? i->alloc * 2 : 16 * 1024;
+        unsigned char *data;
+
+        if (i->total) i->total = 0; /* it lied */
+        while (alloc < i->len + ev->size) alloc *= 2;
+        if (alloc > IMAGE_MAX_SIZE) alloc = IMAGE_MAX_SIZE;
+        data = realloc(i->data, alloc);
+        if (!data)
+          {
+             _chat_image_reject(i);
+             return ECORE_CALLBACK_RENEW;
+          }
+        i->data = data;
+        i->alloc = alloc;
+     }
+   memcpy(i->data + i->len, &ev->data[0], ev->size);
+   i->len += ev->size;
+   _chat_image_progress_update(i);
    return ECORE_CALLBACK_RENEW;
 }
 
@@ -115,13 +414,29 @@ Eina_Bool
 chat_image_complete(void *d __UNUSED__, int type __UNUSED__, Ecore_Con_Event_Url_Complete *ev)
 {
    Image *i = ecore_con_url_data_get(ev->url_con);
-   DBG("%i code for image: %s", ev->status, ecore_con_url_url_get(ev->url_con));
-   if (ev->status != 200)
-     { /* FIXME: update tooltips too */
-        eina_hash_del_by_key(i->cl->images, ecore_con_url_url_get(ev->url_con));
+   Contact_List *cl;
+
+   if (!i) return ECORE_CALLBACK_RENEW;
+   cl = i->cl;
+   DBG("%i code for image: %s", ev->status, i->addr);
+   if ((ev->status != 200) || (!i->len))
+     {
+        eina_hash_del_by_key(cl->images, i->addr);
         return ECORE_CALLBACK_RENEW;
      }
 
+   _chat_image_url_release(i);
+   if (i->len < i->alloc)
+     {
+        unsigned char *data = realloc(i->data, i->len);
+
+        if (data) i->data = data;
+        i->alloc = i->len;
+     }
+   i->done = EINA_TRUE;
+   cl->images_lru = eina_inlist_append(cl->images_lru, EINA_INLIST_GET(i));
+   cl->images_size += i->len;
+   _chat_image_tooltip_refresh(i, i);
+   _chat_image_trim(cl);
    return ECORE_CALLBACK_RENEW;
 }
-
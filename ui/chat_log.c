@@ -0,0 +1,585 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "ui.h"
+
+/* append-only log of every message, one file per account in
+ * $XDG_CACHE_HOME/shotgun/logs/<user@domain>:
+ *
+ * "SGL1" <u32 0> { Chat_Log_Record jid msg <pad to 8> } ...
+ *
+ * every record points back at the previous one for the same contact, so
+ * scrollback is read by walking that chain through an mmap of the file.
+ * <user@domain>.idx holds a Chat_Log_Mark for the newest record of each
+ * contact written in each batch, which gives the chain heads on startup and
+ * lets a walk start near a given time instead of at the end.
+ *
+ * records are collected in memory and written out every CHAT_LOG_FLUSH
+ * seconds, write and fsync being done in a thread. messages are indexed for
+ * searching as they are appended, see chat_search.c.
+ */
+
+#define CHAT_LOG_MAGIC "SGL1"
+#define CHAT_LOG_START 8
+#define CHAT_LOG_FLUSH 2.0
+#define CHAT_LOG_ME (1 << 0)
+#define CHAT_LOG_PAD(X) (((X) + 7) & ~7)
+
+typedef struct
+{
+   uint32_t size; /* whole record, padding included */
+   uint32_t flags;
+   uint64_t prev; /* previous record for the same jid, 0 if none */
+   int64_t time;
+   uint32_t jid_len;
+   uint32_t msg_len;
+} Chat_Log_Record;
+
+typedef struct
+{
+   uint64_t offset;
+   int64_t time;
+} Chat_Log_Mark;
+
+typedef struct
+{
+   const char *jid;
+   uint64_t head; /* newest record */
+   int64_t head_time;
+   Chat_Log_Mark *marks; /* oldest first */
+   unsigned int nmarks;
+   Eina_Bool dirty : 1; /* head isn't in the index yet */
+} Chat_Log_Contact;
+
+struct Chat_Log
+{
+   int fd, idx_fd;
+   uint64_t size; /* including what is still in memory */
+   uint64_t written; /* on disk */
+   Eina_Binbuf *pending, *pending_idx; /* not handed to the thread yet */
+   Eina_Binbuf *flushing, *flushing_idx; /* being written by the thread */
+   Eina_Binbuf *flushing_search;
+   Eina_Bool flushing_full; /* flushing_search replaces the whole index */
+   int error; /* errno of a failed log or index write, set by the thread */
+   int search_error; /* errno of a failed search index write, likewise */
+   Eina_Bool broken; /* the log couldn't be put back after an error */
+   Eina_Bool closing : 1;
+   Ecore_Timer *timer;
+   Ecore_Thread *thread;
+   Eina_Hash *contacts;
+   Chat_Search *search;
+   const unsigned char *map;
+   size_t map_size;
+};
+
+static void
+_chat_log_contact_free(Chat_Log_Contact *lc)
+{
+   eina_stringshare_del(lc->jid);
+   free(lc->marks);
+   free(lc);
+}
+
+static Chat_Log_Contact *
+_chat_log_contact_get(Chat_Log *log, const char *jid, size_t len)
+{
+   Chat_Log_Contact *lc;
+   const char *s;
+
+   s = eina_stringshare_add_length(jid, len);
+   lc = eina_hash_find(log->contacts, s);
+   if (lc)
+     {
+        eina_stringshare_del(s);
+        return lc;
+     }
+   lc = calloc(1, sizeof(Chat_Log_Contact));
+   lc->jid = s;
+   eina_hash_direct_add(log->contacts, lc->jid, lc);
+   return lc;
+}
+
+static void
+_chat_log_mark_add(Chat_Log_Contact *lc, uint64_t offset, int64_t time)
+{
+   Chat_Log_Mark *marks;
+
+   if (lc->nmarks && (lc->marks[lc->nmarks - 1].offset >= offset)) return;
+   marks = realloc(lc->marks, (lc->nmarks + 1) * sizeof(Chat_Log_Mark));
+   if (!marks) return;
+   lc->marks = marks;
+   lc->marks[lc->nmarks].offset = offset;
+   lc->marks[lc->nmarks++].time = time;
+}
+
+/* returns the record at offset, wherever it currently is, or NULL */
+static const Chat_Log_Record *
+_chat_log_record_get(Chat_Log *log, uint64_t offset)
+{
+   const Chat_Log_Record *r;
+   const unsigned char *base;
+   uint64_t start, len;
+
+   if ((offset < CHAT_LOG_START) || (offset & 7) || (offset + sizeof(Chat_Log_Record) > log->size))
+     return NULL;
+   if (offset < log->written)
+     {
+        if (log->map_size < log->written)
+          {  /* more has been written since */
+             void *map;
+
+             if (log->map) munmap((void*)log->map, log->map_size);
+             log->map = NULL;
+             log->map_size = 0;
+             map = mmap(NULL, log->written, PROT_READ, MAP_SHARED, log->fd, 0);
+             if (map == MAP_FAILED) return NULL;
+             log->map = map;
+             log->map_size = log->written;
+          }
+        base = log->map;
+        start = 0;
+        len = log->map_size;
+     }
+   else if (log->flushing && (offset < log->written + eina_binbuf_length_get(log->flushing)))
+     {
+        base = eina_binbuf_string_get(log->flushing);
+        start = log->written;
+        len = eina_binbuf_length_get(log->flushing);
+     }
+   else
+     {
+        base = eina_binbuf_string_get(log->pending);
+        start = log->size - eina_binbuf_length_get(log->pending);
+        len = eina_binbuf_length_get(log->pending);
+     }
+   if (offset + sizeof(Chat_Log_Record) > start + len) return NULL;
+   r = (const Chat_Log_Record*)(base + offset - start);
+   if ((r->size < sizeof(Chat_Log_Record)) || (offset + r->size > start + len) ||
+       ((uint64_t)r->jid_len + r->msg_len + sizeof(Chat_Log_Record) > r->size) ||
+       (r->prev >= offset))
+     return NULL;
+   return r;
+}
+
+/* reads records past the last indexed one, left by an unclean exit */
+static void
+_chat_log_scan(Chat_Log *log, uint64_t offset)
+{
+   const Chat_Log_Record *r;
+
+   while ((offset < log->size) && (r = _chat_log_record_get(log, offset)))
+     {
+        Chat_Log_Contact *lc;
+
+        lc = _chat_log_contact_get(log, (const char*)(r + 1), r->jid_len);
+        lc->head = offset;
+        lc->head_time = r->time;
+        lc->dirty = EINA_TRUE;
+        offset += r->size;
+     }
+   if (offset < log->size)
+     {  /* torn write */
+        WRN("Chat log truncated at %llu", (unsigned long long)offset);
+        if (ftruncate(log->fd, offset)) ERR("Could not truncate chat log: %s", strerror(errno));
+        log->size = log->written = offset;
+     }
+}
+
+static void
+_chat_log_index_load(Chat_Log *log)
+{
+   Chat_Log_Mark mark;
+   uint64_t end = CHAT_LOG_START;
+
+   while (read(log->idx_fd, &mark, sizeof(mark)) == sizeof(mark))
+     {
+        const Chat_Log_Record *r;
+        Chat_Log_Contact *lc;
+
+        r = _chat_log_record_get(log, mark.offset);
+        if (!r) continue;
+        lc = _chat_log_contact_get(log, (const char*)(r + 1), r->jid_len);
+        _chat_log_mark_add(lc, mark.offset, r->time);
+        if (mark.offset > lc->head)
+          {
+             lc->head = mark.offset;
+             lc->head_time = r->time;
+          }
+        if (mark.offset + r->size > end) end = mark.offset + r->size;
+     }
+   _chat_log_scan(log, end);
+}
+
+/* indexes whatever the search index doesn't know about yet */
+static void
+_chat_log_search_update(Chat_Log *log)
+{
+   const Chat_Log_Record *r;
+   uint64_t offset;
+
+   offset = chat_search_end_get(log->search);
+   if (offset > log->size)
+     {  /* the log has been cut short since */
+        chat_search_reset(log->search);
+        offset = 0;
+     }
+   if (offset < CHAT_LOG_START) offset = CHAT_LOG_START;
+   if (offset < log->size)
+     INF("Indexing %llu bytes of chat log", (unsigned long long)(log->size - offset));
+   for (; (offset < log->size) && (r = _chat_log_record_get(log, offset)); offset += r->size)
+     chat_search_add(log->search, offset, offset + r->size, (const char*)(r + 1) + r->jid_len, r->msg_len);
+}
+
+static Eina_Bool _chat_log_flush(Chat_Log *log);
+
+Chat_Log *
+chat_log_new(const char *account)
+{
+   char dir[PATH_MAX], path[PATH_MAX];
+   const char *p;
+   struct stat st;
+   Chat_Log *log;
+   size_t len;
+   char *s;
+
+   if (!shotgun_cache_dir(dir, sizeof(dir), "logs")) return NULL;
+   p = strchr(account, '/');
+   snprintf(path, sizeof(path), "%s/%.*s", dir, p ? (int)(p - account) : (int)strlen(account), account);
+   for (s = path + strlen(dir) + 1; *s; s++)
+     if (*s == '/') *s = '_';
+
+   log = calloc(1, sizeof(Chat_Log));
+   log->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+   if ((log->fd < 0) || fstat(log->fd, &st))
+     {
+        ERR("Could not open chat log %s: %s", path, strerror(errno));
+        goto error;
+     }
+   if (!st.st_size)
+     {
+        if (write(log->fd, CHAT_LOG_MAGIC "\0\0\0", CHAT_LOG_START) != CHAT_LOG_START) goto error;
+        st.st_size = CHAT_LOG_START;
+     }
+   else
+     {
+        char magic[sizeof(CHAT_LOG_MAGIC) - 1];
+
+        if ((pread(log->fd, magic, sizeof(magic), 0) != sizeof(magic)) ||
+            memcmp(magic, CHAT_LOG_MAGIC, sizeof(magic)))
+          {
+             ERR("%s is not a chat log", path);
+             goto error;
+          }
+     }
+   len = strlen(path);
+   strcpy(path + len, ".idx");
+   log->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+   if (log->idx_fd < 0)
+     {
+        ERR("Could not open chat log index %s: %s", path, strerror(errno));
+        goto error;
+     }
+
+   log->size = log->written = st.st_size;
+   log->pending = eina_binbuf_new();
+   log->pending_idx = eina_binbuf_new();
+   log->contacts = eina_hash_stringshared_new((Eina_Free_Cb)_chat_log_contact_free);
+   _chat_log_index_load(log);
+   strcpy(path + len, ".search");
+   log->search = chat_search_new(path);
+   _chat_log_search_update(log);
+   log->timer = ecore_timer_add(CHAT_LOG_FLUSH, (Ecore_Task_Cb)_chat_log_flush, log);
+   INF("Chat log for %s: %d contacts, %llu bytes", account,
+       eina_hash_population(log->contacts), (unsigned long long)log->size);
+   return log;
+error:
+   if (log->fd >= 0) close(log->fd);
+   free(log);
+   return NULL;
+}
+
+static void
+_chat_log_write(Chat_Log *log, Ecore_Thread *thread __UNUSED__)
+{
+   const unsigned char *p;
+   off_t idx_size;
+   size_t len;
+   ssize_t n;
+
+   idx_size = lseek(log->idx_fd, 0, SEEK_END);
+   if (idx_size < 0) goto error;
+   /* the index only ever points at records which are safely written */
+   p = eina_binbuf_string_get(log->flushing);
+   for (len = eina_binbuf_length_get(log->flushing); len; len -= n, p += n)
+     {
+        n = write(log->fd, p, len);
+        if ((n < 0) && (errno == EINTR)) n = 0;
+        else if (n <= 0) goto error;
+     }
+   if (fdatasync(log->fd)) goto error;
+
+   p = eina_binbuf_string_get(log->flushing_idx);
+   for (len = eina_binbuf_length_get(log->flushing_idx); len; len -= n, p += n)
+     {
+        n = write(log->idx_fd, p, len);
+        if ((n < 0) && (errno == EINTR)) n = 0;
+        else if (n <= 0) goto error;
+     }
+   if (fdatasync(log->idx_fd)) goto error;
+
+   /* and the search index only ever points at records in the log */
+   if (log->flushing_search)
+     log->search_error = chat_search_segment_write(log->search, log->flushing_search, log->flushing_full);
+   return;
+error:
+   log->error = errno;
+   /* drop whatever made it out, all of it is written again next time */
+   if (ftruncate(log->fd, log->written) || ((idx_size >= 0) && ftruncate(log->idx_fd, idx_size)))
+     log->broken = EINA_TRUE;
+}
+
+static void _chat_log_close(Chat_Log *log);
+
+static void
+_chat_log_write_end(Chat_Log *log, Ecore_Thread *thread __UNUSED__)
+{
+   if (log->search_error)
+     ERR("Could not write chat search index: %s", strerror(log->search_error));
+   if (log->flushing_search && (log->error || log->search_error))
+     chat_search_segment_lost(log->search);
+   if (!log->error)
+     log->written += eina_binbuf_length_get(log->flushing);
+   else if (log->broken)
+     {  /* the file isn't what the offsets say anymore */
+        ERR("Could not write chat log, giving up on it: %s", strerror(log->error));
+        eina_binbuf_reset(log->pending);
+        eina_binbuf_reset(log->pending_idx);
+        log->size = log->written;
+        /* the index has postings for what was just dropped */
+        chat_search_reset(log->search);
+        _chat_log_search_update(log);
+     }
+   else
+     {  /* put it back in front of what came since and try again later */
+        WRN("Could not write chat log: %s", strerror(log->error));
+        eina_binbuf_append_length(log->flushing, eina_binbuf_string_get(log->pending),
+                                  eina_binbuf_length_get(log->pending));
+        eina_binbuf_append_length(log->flushing_idx, eina_binbuf_string_get(log->pending_idx),
+                                  eina_binbuf_length_get(log->pending_idx));
+        eina_binbuf_free(log->pending);
+        eina_binbuf_free(log->pending_idx);
+        log->pending = log->flushing;
+        log->pending_idx = log->flushing_idx;
+        log->flushing = log->flushing_idx = NULL;
+        if ((!log->timer) && (!log->closing))
+          log->timer = ecore_timer_add(CHAT_LOG_FLUSH, (Ecore_Task_Cb)_chat_log_flush, log);
+     }
+   if (log->flushing) eina_binbuf_free(log->flushing);
+   if (log->flushing_idx) eina_binbuf_free(log->flushing_idx);
+   if (log->flushing_search) eina_binbuf_free(log->flushing_search);
+   log->flushing = log->flushing_idx = log->flushing_search = NULL;
+   log->thread = NULL;
+   if (log->closing) _chat_log_close(log);
+}
+
+static Eina_Bool
+_chat_log_index_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Chat_Log_Contact *lc, Chat_Log *log)
+{
+   Chat_Log_Mark mark;
+
+   if (!lc->dirty) return EINA_TRUE;
+   mark.offset = lc->head;
+   mark.time = lc->head_time;
+   eina_binbuf_append_length(log->pending_idx, (unsigned char*)&mark, sizeof(mark));
+   _chat_log_mark_add(lc, mark.offset, mark.time);
+   lc->dirty = EINA_FALSE;
+   return EINA_TRUE;
+}
+
+/* moves everything not written yet to the flushing buffers */
+static Eina_Bool
+_chat_log_flush_prepare(Chat_Log *log)
+{
+   if (log->broken) return EINA_FALSE;
+   log->flushing_search = chat_search_segment_get(log->search, &log->flushing_full);
+   if ((!eina_binbuf_length_get(log->pending)) && (!log->flushing_search)) return EINA_FALSE;
+
+   eina_hash_foreach(log->contacts, (Eina_Hash_Foreach)_chat_log_index_cb, log);
+   log->flushing = log->pending;
+   log->flushing_idx = log->pending_idx;
+   log->pending = log->pending_idx = NULL;
+   log->error = log->search_error = 0;
+   return EINA_TRUE;
+}
+
+/* hands what has been logged so far to a thread */
+static Eina_Bool
+_chat_log_flush(Chat_Log *log)
+{
+   if (log->thread) return EINA_TRUE; /* next time */
+   log->timer = NULL;
+   if (!_chat_log_flush_prepare(log)) return EINA_FALSE;
+
+   log->pending = eina_binbuf_new();
+   log->pending_idx = eina_binbuf_new();
+   log->thread = ecore_thread_run((Ecore_Thread_Cb)_chat_log_write, (Ecore_Thread_Cb)_chat_log_write_end,
+                                  (Ecore_Thread_Cb)_chat_log_write_end, log);
+   return EINA_FALSE;
+}
+
+void
+chat_log_append(Chat_Log *log, const char *jid, const char *msg, Eina_Bool me, time_t t)
+{
+   static const unsigned char pad[8];
+   Chat_Log_Contact *lc;
+   Chat_Log_Record r;
+   const char *p;
+   size_t jid_len, msg_len;
+
+   if ((!log) || (!msg) || log->broken) return;
+   p = strchr(jid, '/');
+   jid_len = p ? (size_t)(p - jid) : strlen(jid);
+   msg_len = strlen(msg);
+   lc = _chat_log_contact_get(log, jid, jid_len);
+
+   r.size = CHAT_LOG_PAD(sizeof(r) + jid_len + msg_len);
+   r.flags = me ? CHAT_LOG_ME : 0;
+   r.prev = lc->head;
+   r.time = t;
+   r.jid_len = jid_len;
+   r.msg_len = msg_len;
+   eina_binbuf_append_length(log->pending, (unsigned char*)&r, sizeof(r));
+   eina_binbuf_append_length(log->pending, (unsigned char*)jid, jid_len);
+   eina_binbuf_append_length(log->pending, (unsigned char*)msg, msg_len);
+   eina_binbuf_append_length(log->pending, pad, r.size - sizeof(r) - jid_len - msg_len);
+
+   chat_search_add(log->search, log->size, log->size + r.size, msg, msg_len);
+   lc->head = log->size;
+   lc->head_time = t;
+   lc->dirty = EINA_TRUE;
+   log->size += r.size;
+   if (!log->timer)
+     log->timer = ecore_timer_add(CHAT_LOG_FLUSH, (Ecore_Task_Cb)_chat_log_flush, log);
+}
+
+/* calls cb with up to max of jid's messages older than before (or the last
+ * ones if before is 0), oldest first. returns how many there were.
+ */
+unsigned int
+chat_log_page(Chat_Log *log, const char *jid, time_t before, unsigned int max, Chat_Log_Cb cb, void *data)
+{
+   Chat_Log_Contact *lc;
+   const Chat_Log_Record *r;
+   uint64_t *offsets, offset;
+   unsigned int i, n = 0;
+   const char *s;
+
+   if ((!log) || (!max)) return 0;
+   s = eina_stringshare_add(jid);
+   lc = eina_hash_find(log->contacts, s);
+   eina_stringshare_del(s);
+   if ((!lc) || (!lc->head)) return 0;
+
+   offset = lc->head;
+   if (before)
+     {  /* start from the oldest mark which is not older than before */
+        for (i = 0; i < lc->nmarks; i++)
+          if (lc->marks[i].time >= before)
+            {
+               offset = lc->marks[i].offset;
+               break;
+            }
+     }
+   offsets = alloca(max * sizeof(uint64_t));
+   while (offset && (n < max) && (r = _chat_log_record_get(log, offset)))
+     {
+        if ((!before) || (r->time < before)) offsets[n++] = offset;
+        offset = r->prev;
+     }
+   for (i = n; i; i--)
+     {
+        char *msg;
+
+        r = _chat_log_record_get(log, offsets[i - 1]);
+        if (!r) continue;
+        msg = strndup((const char*)(r + 1) + r->jid_len, r->msg_len);
+        cb(data, msg, !!(r->flags & CHAT_LOG_ME), r->time);
+        free(msg);
+     }
+   return n;
+}
+
+/* calls cb with up to max messages holding every word of query, newest first.
+ * returns how many there were.
+ */
+unsigned int
+chat_log_search(Chat_Log *log, const char *query, unsigned int max, Chat_Log_Search_Cb cb, void *data)
+{
+   const Chat_Log_Record *r;
+   uint64_t *offsets;
+   unsigned int i, n, found = 0;
+
+   if ((!log) || (!max)) return 0;
+   offsets = malloc(max * sizeof(uint64_t));
+   if (!offsets) return 0;
+   n = chat_search_query(log->search, query, offsets, max);
+   for (i = 0; i < n; i++)
+     {
+        char *jid, *msg;
+
+        r = _chat_log_record_get(log, offsets[i]);
+        if (!r) continue;
+        jid = strndup((const char*)(r + 1), r->jid_len);
+        msg = strndup((const char*)(r + 1) + r->jid_len, r->msg_len);
+        cb(data, jid, msg, !!(r->flags & CHAT_LOG_ME), r->time);
+        free(jid);
+        free(msg);
+        found++;
+     }
+   free(offsets);
+   return found;
+}
+
+static void
+_chat_log_close(Chat_Log *log)
+{
+   if (_chat_log_flush_prepare(log))
+     {  /* last words, nothing left to block */
+        _chat_log_write(log, NULL);
+        if (log->error) ERR("Could not write chat log: %s", strerror(log->error));
+        if (log->search_error) ERR("Could not write chat search index: %s", strerror(log->search_error));
+        eina_binbuf_free(log->flushing);
+        eina_binbuf_free(log->flushing_idx);
+        if (log->flushing_search) eina_binbuf_free(log->flushing_search);
+     }
+   else
+     {
+        eina_binbuf_free(log->pending);
+        eina_binbuf_free(log->pending_idx);
+     }
+   if (log->map) munmap((void*)log->map, log->map_size);
+   eina_hash_free(log->contacts);
+   chat_search_free(log->search);
+   close(log->fd);
+   close(log->idx_fd);
+   free(log);
+}
+
+void
+chat_log_free(Chat_Log *log)
+{
+   if (!log) return;
+   if (log->timer) ecore_timer_del(log->timer);
+   log->timer = NULL;
+   if (log->thread)
+     {  /* finish once the thread is done with it */
+        log->closing = EINA_TRUE;
+        return;
+     }
+   _chat_log_close(log);
+}
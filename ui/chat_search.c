@@ -0,0 +1,516 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ui.h"
+
+/* inverted index over the chat log: every word maps to the offsets of the
+ * log records containing it. offsets only ever grow and are 8 byte aligned,
+ * so a posting list is kept as varints of (offset - previous offset) >> 3,
+ * which is one or two bytes per message for anything but the rarest words.
+ *
+ * it is stored next to the log as <user@domain>.search:
+ *
+ * "SGS1" <u32 0> { <u32 size> <u64 end> { <u8 len> term <varint bytes> postings } ... } ...
+ *
+ * each flush of the log appends a segment holding only what was added since,
+ * where end is the log offset everything before has been indexed up to and
+ * the first posting of a list is absolute. segments are merged into a single
+ * one once there are CHAT_SEARCH_SEGMENTS of them. whatever the index misses
+ * after an unclean exit is read back from the log on startup.
+ */
+
+#define CHAT_SEARCH_MAGIC "SGS1"
+#define CHAT_SEARCH_START 8
+#define CHAT_SEARCH_SEGMENTS 64
+#define CHAT_SEARCH_TOKEN_MIN 2
+#define CHAT_SEARCH_TOKEN_MAX 32
+#define CHAT_SEARCH_QUERY_MAX 8
+
+typedef struct
+{
+   uint32_t size; /* of what follows the header */
+   uint32_t pad;
+   uint64_t end;
+} Chat_Search_Segment;
+
+typedef struct
+{
+   const char *term;
+   unsigned char *buf; /* postings */
+   size_t len, alloc;
+   uint64_t last; /* newest posting */
+   size_t seg; /* start of the postings not written yet */
+   uint64_t seg_prev; /* posting before those */
+   Eina_Bool dirty : 1;
+} Chat_Search_Term;
+
+struct Chat_Search
+{
+   char *path;
+   int fd; /* replaced by the writer thread on a merge */
+   uint64_t end;
+   unsigned int segments;
+   Eina_Hash *terms;
+   Eina_List *dirty;
+};
+
+static size_t
+_chat_search_varint_put(unsigned char *p, uint64_t v)
+{
+   size_t n = 0;
+
+   while (v >= 0x80)
+     {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+     }
+   p[n++] = v;
+   return n;
+}
+
+/* returns the number of bytes read, 0 if p doesn't hold a whole varint */
+static size_t
+_chat_search_varint_get(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+   size_t n = 0;
+   unsigned int shift = 0;
+
+   *v = 0;
+   while ((p + n < end) && (shift < 64))
+     {
+        *v |= (uint64_t)(p[n] & 0x7f) << shift;
+        if (!(p[n++] & 0x80)) return n;
+        shift += 7;
+     }
+   return 0;
+}
+
+static void
+_chat_search_term_free(Chat_Search_Term *t)
+{
+   eina_stringshare_del(t->term);
+   free(t->buf);
+   free(t);
+}
+
+static Eina_Bool
+_chat_search_term_grow(Chat_Search_Term *t, size_t len)
+{
+   unsigned char *buf;
+   size_t alloc;
+
+   if (t->len + len <= t->alloc) return EINA_TRUE;
+   alloc = t->alloc ? t->alloc : 8;
+   while (alloc < t->len + len) alloc *= 2;
+   buf = realloc(t->buf, alloc);
+   if (!buf) return EINA_FALSE;
+   t->buf = buf;
+   t->alloc = alloc;
+   return EINA_TRUE;
+}
+
+static Chat_Search_Term *
+_chat_search_term_get(Chat_Search *s, const char *term, size_t len, Eina_Bool create)
+{
+   Chat_Search_Term *t;
+   const char *key;
+
+   key = eina_stringshare_add_length(term, len);
+   t = eina_hash_find(s->terms, key);
+   if (t || (!create))
+     {
+        eina_stringshare_del(key);
+        return t;
+     }
+   t = calloc(1, sizeof(Chat_Search_Term));
+   t->term = key;
+   eina_hash_direct_add(s->terms, t->term, t);
+   return t;
+}
+
+static void
+_chat_search_posting_add(Chat_Search *s, Chat_Search_Term *t, uint64_t offset)
+{
+   if (offset <= t->last) return; /* word seen twice in a message */
+   if (!_chat_search_term_grow(t, 10)) return;
+   if (!t->dirty)
+     {
+        t->seg = t->len;
+        t->seg_prev = t->last;
+        t->dirty = EINA_TRUE;
+        s->dirty = eina_list_append(s->dirty, t);
+     }
+   t->len += _chat_search_varint_put(t->buf + t->len, (offset - t->last) >> 3);
+   t->last = offset;
+}
+
+/* finds the next word in [p, end), lowercased into tok.
+ * anything that isn't ascii punctuation or space is part of a word,
+ * words which are too long are cut short
+ */
+static const char *
+_chat_search_token(const char *p, const char *end, char *tok, size_t *len)
+{
+   for (;;)
+     {
+        *len = 0;
+        while ((p < end) && (!isalnum((unsigned char)*p)) && (!(*p & 0x80))) p++;
+        if (p == end) return NULL;
+        for (; (p < end) && (isalnum((unsigned char)*p) || (*p & 0x80)); p++)
+          if (*len < CHAT_SEARCH_TOKEN_MAX) tok[(*len)++] = tolower((unsigned char)*p);
+        if (*len >= CHAT_SEARCH_TOKEN_MIN) return p;
+     }
+}
+
+/* indexes the message of the record at offset, end being the offset of the next record */
+void
+chat_search_add(Chat_Search *s, uint64_t offset, uint64_t end, const char *msg, size_t len)
+{
+   const char *p = msg;
+   char tok[CHAT_SEARCH_TOKEN_MAX];
+   size_t tok_len;
+
+   if (!s) return;
+   while ((p = _chat_search_token(p, msg + len, tok, &tok_len)))
+     _chat_search_posting_add(s, _chat_search_term_get(s, tok, tok_len, EINA_TRUE), offset);
+   s->end = end;
+}
+
+uint64_t
+chat_search_end_get(Chat_Search *s)
+{
+   return s ? s->end : 0;
+}
+
+/* reads a segment body, only checking it unless apply is set */
+static Eina_Bool
+_chat_search_segment_read(Chat_Search *s, const unsigned char *p, const unsigned char *end, Eina_Bool apply)
+{
+   while (p < end)
+     {
+        Chat_Search_Term *t = NULL;
+        const unsigned char *q;
+        uint64_t v, size, offset;
+        size_t n, len;
+
+        len = *p++;
+        if ((!len) || (len > CHAT_SEARCH_TOKEN_MAX) || ((size_t)(end - p) < len)) return EINA_FALSE;
+        if (apply) t = _chat_search_term_get(s, (const char*)p, len, EINA_TRUE);
+        p += len;
+        n = _chat_search_varint_get(p, end, &size);
+        if ((!n) || ((uint64_t)(end - p - n) < size)) return EINA_FALSE;
+        p += n;
+        q = p + size;
+        n = _chat_search_varint_get(p, q, &offset);
+        if ((!n) || (!offset)) return EINA_FALSE;
+        offset <<= 3;
+        if (apply)
+          {  /* the first one is absolute, the rest can be copied over as is */
+             if ((offset <= t->last) || (!_chat_search_term_grow(t, 10 + size - n))) return EINA_FALSE;
+             t->len += _chat_search_varint_put(t->buf + t->len, (offset - t->last) >> 3);
+             memcpy(t->buf + t->len, p + n, size - n);
+             t->len += size - n;
+          }
+        for (p += n; p < q; p += n)
+          {
+             n = _chat_search_varint_get(p, q, &v);
+             if ((!n) || (!v)) return EINA_FALSE;
+             offset += v << 3;
+          }
+        if (t) t->last = offset;
+     }
+   return EINA_TRUE;
+}
+
+static void
+_chat_search_load(Chat_Search *s)
+{
+   const unsigned char *map, *p, *end;
+   struct stat st;
+
+   if (fstat(s->fd, &st) || (st.st_size < CHAT_SEARCH_START)) goto reset;
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+   if (map == MAP_FAILED) goto reset;
+   if (memcmp(map, CHAT_SEARCH_MAGIC, sizeof(CHAT_SEARCH_MAGIC) - 1))
+     {
+        ERR("Discarding unreadable search index %s", s->path);
+        munmap((void*)map, st.st_size);
+        goto reset;
+     }
+
+   p = map + CHAT_SEARCH_START;
+   end = map + st.st_size;
+   while (p < end)
+     {
+        Chat_Search_Segment seg;
+
+        if ((size_t)(end - p) < sizeof(seg)) break;
+        memcpy(&seg, p, sizeof(seg));
+        if ((seg.size > (size_t)(end - p - sizeof(seg))) || (seg.end < s->end)) break;
+        p += sizeof(seg);
+        if (!_chat_search_segment_read(s, p, p + seg.size, EINA_FALSE)) break;
+        if (!_chat_search_segment_read(s, p, p + seg.size, EINA_TRUE))
+          {  /* postings out of order, don't trust any of it */
+             ERR("Discarding inconsistent search index %s", s->path);
+             munmap((void*)map, st.st_size);
+             eina_hash_free_buckets(s->terms);
+             s->end = 0;
+             s->segments = 0;
+             goto reset;
+          }
+        s->end = seg.end;
+        s->segments++;
+        p += seg.size;
+     }
+   if (p < end)
+     {  /* torn write, the log has the rest */
+        WRN("Search index truncated at %lu", (unsigned long)(p - map));
+        if (ftruncate(s->fd, p - map)) ERR("Could not truncate search index: %s", strerror(errno));
+     }
+   munmap((void*)map, st.st_size);
+   return;
+reset:
+   if (ftruncate(s->fd, 0) || (write(s->fd, CHAT_SEARCH_MAGIC "\0\0\0", CHAT_SEARCH_START) != CHAT_SEARCH_START))
+     ERR("Could not create search index %s: %s", s->path, strerror(errno));
+}
+
+Chat_Search *
+chat_search_new(const char *path)
+{
+   Chat_Search *s;
+
+   s = calloc(1, sizeof(Chat_Search));
+   s->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+   if (s->fd < 0)
+     {
+        ERR("Could not open search index %s: %s", path, strerror(errno));
+        free(s);
+        return NULL;
+     }
+   s->path = strdup(path);
+   s->terms = eina_hash_stringshared_new((Eina_Free_Cb)_chat_search_term_free);
+   _chat_search_load(s);
+   INF("Search index: %d words, %u segments", eina_hash_population(s->terms), s->segments);
+   return s;
+}
+
+/* forgets everything, for when the index doesn't match the log anymore */
+void
+chat_search_reset(Chat_Search *s)
+{
+   if (!s) return;
+   s->dirty = eina_list_free(s->dirty);
+   eina_hash_free_buckets(s->terms);
+   s->end = 0;
+   s->segments = CHAT_SEARCH_SEGMENTS; /* rewrite it all on the next flush */
+}
+
+void
+chat_search_free(Chat_Search *s)
+{
+   if (!s) return;
+   eina_list_free(s->dirty);
+   eina_hash_free(s->terms);
+   close(s->fd);
+   free(s->path);
+   free(s);
+}
+
+static void
+_chat_search_segment_term(Eina_Binbuf *buf, const Chat_Search_Term *t, const unsigned char *p, uint64_t first, size_t rest)
+{
+   unsigned char tmp[10], size[10];
+   size_t n;
+
+   n = _chat_search_varint_put(tmp, first >> 3);
+   eina_binbuf_append_char(buf, eina_stringshare_strlen(t->term));
+   eina_binbuf_append_length(buf, (const unsigned char*)t->term, eina_stringshare_strlen(t->term));
+   eina_binbuf_append_length(buf, size, _chat_search_varint_put(size, n + rest));
+   eina_binbuf_append_length(buf, tmp, n);
+   eina_binbuf_append_length(buf, p, rest);
+}
+
+static Eina_Bool
+_chat_search_all_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Chat_Search_Term *t, Eina_Binbuf *buf)
+{
+   uint64_t first;
+   size_t n;
+
+   /* the first posting of the whole list is already absolute */
+   n = _chat_search_varint_get(t->buf, t->buf + t->len, &first);
+   _chat_search_segment_term(buf, t, t->buf + n, first << 3, t->len - n);
+   t->dirty = EINA_FALSE;
+   return EINA_TRUE;
+}
+
+/* returns what has to be written since the last call, NULL if nothing.
+ * full is set if it replaces the whole file rather than being appended
+ */
+Eina_Binbuf *
+chat_search_segment_get(Chat_Search *s, Eina_Bool *full)
+{
+   Chat_Search_Segment seg;
+   Chat_Search_Term *t;
+   Eina_Binbuf *buf;
+
+   if ((!s) || ((!s->dirty) && (s->segments < CHAT_SEARCH_SEGMENTS))) return NULL;
+   buf = eina_binbuf_new();
+   *full = s->segments >= CHAT_SEARCH_SEGMENTS;
+   if (*full)
+     eina_binbuf_append_length(buf, (const unsigned char*)CHAT_SEARCH_MAGIC "\0\0\0", CHAT_SEARCH_START);
+   memset(&seg, 0, sizeof(seg));
+   eina_binbuf_append_length(buf, (const unsigned char*)&seg, sizeof(seg));
+
+   if (*full)
+     {
+        eina_hash_foreach(s->terms, (Eina_Hash_Foreach)_chat_search_all_cb, buf);
+        s->dirty = eina_list_free(s->dirty);
+        s->segments = 1;
+     }
+   else
+     {
+        EINA_LIST_FREE(s->dirty, t)
+          {
+             uint64_t v;
+             size_t n;
+
+             n = _chat_search_varint_get(t->buf + t->seg, t->buf + t->len, &v);
+             _chat_search_segment_term(buf, t, t->buf + t->seg + n, t->seg_prev + (v << 3), t->len - t->seg - n);
+             t->dirty = EINA_FALSE;
+          }
+        s->segments++;
+     }
+   seg.size = eina_binbuf_length_get(buf) - sizeof(seg) - (*full ? CHAT_SEARCH_START : 0);
+   seg.end = s->end;
+   memcpy((unsigned char*)eina_binbuf_string_get(buf) + (*full ? CHAT_SEARCH_START : 0), &seg, sizeof(seg));
+   return buf;
+}
+
+/* the last segment never made it to disk. its terms aren't dirty anymore,
+ * so the whole index gets rewritten on the next flush instead
+ */
+void
+chat_search_segment_lost(Chat_Search *s)
+{
+   if (!s) return;
+   s->segments = CHAT_SEARCH_SEGMENTS;
+}
+
+/* called from the log's writer thread */
+int
+chat_search_segment_write(Chat_Search *s, Eina_Binbuf *buf, Eina_Bool full)
+{
+   char path[PATH_MAX];
+   const unsigned char *p;
+   size_t len;
+   ssize_t n;
+   int fd = s->fd;
+
+   if (full)
+     {
+        snprintf(path, sizeof(path), "%s.tmp", s->path);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+        if (fd < 0) return errno;
+     }
+   p = eina_binbuf_string_get(buf);
+   for (len = eina_binbuf_length_get(buf); len; len -= n, p += n)
+     {
+        n = write(fd, p, len);
+        if ((n < 0) && (errno == EINTR)) n = 0;
+        else if (n <= 0) goto error;
+     }
+   if (fdatasync(fd)) goto error;
+   if (!full) return 0;
+
+   if (rename(path, s->path)) goto error;
+   close(s->fd);
+   s->fd = fd;
+   return 0;
+error:
+   n = errno;
+   if (full)
+     {
+        close(fd);
+        unlink(path);
+     }
+   return n;
+}
+
+static int
+_chat_search_term_sort(const void *a, const void *b)
+{
+   const Chat_Search_Term *ta = *(const Chat_Search_Term**)a, *tb = *(const Chat_Search_Term**)b;
+
+   return (ta->len > tb->len) - (ta->len < tb->len);
+}
+
+/* fills offsets with up to max records holding every word of query, newest first */
+unsigned int
+chat_search_query(Chat_Search *s, const char *query, uint64_t *offsets, unsigned int max)
+{
+   Chat_Search_Term *terms[CHAT_SEARCH_QUERY_MAX];
+   char tok[CHAT_SEARCH_TOKEN_MAX];
+   const unsigned char *p, *end;
+   const char *q = query, *qend = query + strlen(query);
+   uint64_t *hits, offset, v;
+   unsigned int i, j, k, nterms = 0, nhits = 0;
+   size_t tok_len, n;
+
+   if ((!s) || (!max)) return 0;
+   while ((nterms < CHAT_SEARCH_QUERY_MAX) && (q = _chat_search_token(q, qend, tok, &tok_len)))
+     {
+        Chat_Search_Term *t;
+
+        t = _chat_search_term_get(s, tok, tok_len, EINA_FALSE);
+        if (!t) return 0;
+        for (i = 0; i < nterms; i++)
+          if (terms[i] == t) break;
+        if (i == nterms) terms[nterms++] = t;
+     }
+   if (!nterms) return 0;
+   /* start from the rarest word, every other one can only drop hits */
+   qsort(terms, nterms, sizeof(Chat_Search_Term*), _chat_search_term_sort);
+
+   /* no posting is shorter than a byte */
+   hits = malloc(terms[0]->len * sizeof(uint64_t));
+   if (!hits) return 0;
+   end = terms[0]->buf + terms[0]->len;
+   for (p = terms[0]->buf, offset = 0; p < end; p += n)
+     {
+        n = _chat_search_varint_get(p, end, &v);
+        if (!n) break;
+        offset += v << 3;
+        hits[nhits++] = offset;
+     }
+   for (i = 1; (i < nterms) && nhits; i++)
+     {  /* both are sorted, merge */
+        end = terms[i]->buf + terms[i]->len;
+        p = terms[i]->buf;
+        offset = 0;
+        for (j = k = 0; j < nhits; j++)
+          {
+             while (offset < hits[j])
+               {
+                  n = _chat_search_varint_get(p, end, &v);
+                  if (!n) goto next;
+                  offset += v << 3;
+                  p += n;
+               }
+             if (offset == hits[j]) hits[k++] = hits[j];
+          }
+next:
+        nhits = k;
+     }
+
+   for (i = 0; (i < max) && (i < nhits); i++)
+     offsets[i] = hits[nhits - i - 1];
+   free(hits);
+   return i;
+}
@@ -15,7 +15,7 @@ contact_free(Contact *c)
    shotgun_user_free(c->base);
    shotgun_user_info_free(c->info);
    c->list->users_list = eina_list_remove(c->list->users_list, c);
-   eina_stringshare_del(c->last_conv);
+   chat_history_free(c);
    eina_stringshare_del(c->tooltip_label);
    free(c);
 }
@@ -32,6 +32,20 @@ do_something_with_user(Contact_List *cl, Shotgun_User *user)
    c = eina_hash_find(cl->users, jid);
 
    if (c)
+     {  /* roster push or resync */
+        if (user->subscription == SHOTGUN_USER_SUBSCRIPTION_REMOVE)
+          {
+             eina_hash_del_by_key(cl->users, jid);
+             shotgun_user_free(user);
+             return;
+          }
+        shotgun_user_free(c->base);
+        c->base = user;
+        c->tooltip_changed = EINA_TRUE;
+        if (c->list_item) cl->list_item_update[cl->mode](c->list_item);
+        return;
+     }
+   if (user->subscription == SHOTGUN_USER_SUBSCRIPTION_REMOVE)
      {
         shotgun_user_free(user);
         return;
@@ -6,10 +6,15 @@ _contact_list_free_cb(Contact_List *cl, Evas *e __UNUSED__, Evas_Object *obj __U
    ecore_event_handler_del(cl->event_handlers.iq);
    ecore_event_handler_del(cl->event_handlers.presence);
    ecore_event_handler_del(cl->event_handlers.message);
+   ecore_event_handler_del(cl->event_handlers.connect);
 
    eina_hash_free(cl->users);
+   /* nothing new should start while the images go */
+   cl->images_queue = eina_list_free(cl->images_queue);
    eina_hash_free(cl->images);
    eina_hash_free(cl->user_convs);
+   contact_thumbs_free(cl);
+   chat_log_free(cl->log);
    cl->users_list = eina_list_free(cl->users_list);
 
    free(cl);
@@ -99,10 +104,9 @@ _it_icon_get(Contact *c, Evas_Object *obj, const char *part)
 {
    Evas_Object *ic;
 
-   if ((!c->info) || (!c->info->photo.data) || strcmp(part, "elm.swallow.end")) return NULL;
-   ic = elm_icon_add(obj);
-   elm_icon_memfile_set(ic, c->info->photo.data, c->info->photo.size, NULL, NULL);
-   evas_object_size_hint_aspect_set(ic, EVAS_ASPECT_CONTROL_VERTICAL, 1, 1);
+   if ((!c->info) || strcmp(part, "elm.swallow.end")) return NULL;
+   ic = contact_thumb_get(c->list, c, obj);
+   if (!ic) return NULL;
    evas_object_show(ic);
 
    return ic;
@@ -360,6 +364,7 @@ contact_list_new(Shotgun_Auth *auth)
 
    cl = calloc(1, sizeof(Contact_List));
    cl->account = auth;
+   cl->log = chat_log_new(shotgun_jid_get(auth));
 
    cl->win = win = elm_win_add(NULL, "Shotgun - Contacts", ELM_WIN_BASIC);
    elm_win_title_set(win, "Shotgun - Contacts");
@@ -491,6 +496,9 @@ contact_list_new(Shotgun_Auth *auth)
    cl->event_handlers.message =
       ecore_event_handler_add(SHOTGUN_EVENT_MESSAGE, (Ecore_Event_Handler_Cb)event_message_cb,
                               cl);
+   cl->event_handlers.connect =
+      ecore_event_handler_add(SHOTGUN_EVENT_CONNECT, (Ecore_Event_Handler_Cb)event_connect_cb,
+                              cl);
 
    evas_object_data_set(win, "contact-list", cl);
 
@@ -0,0 +1,165 @@
+#include "ui.h"
+
+/* avatars are decoded once per contact and size, scaled down to fit the
+ * list or grid icon and kept as ARGB pixels; realizing an item is then only
+ * a pixel copy. entries are keyed by jid and dropped when the photo hash
+ * changes, least recently used entries go first once over budget.
+ */
+
+#define CONTACT_THUMB_BUDGET (4 * 1024 * 1024)
+
+static const int contact_thumb_sizes[2] = { 48, 64 }; /* list, grid */
+
+static size_t
+_contact_thumb_pixels_free(Contact_Thumb *t)
+{
+   size_t size = 0;
+   unsigned int i;
+
+   for (i = 0; i < 2; i++)
+     {
+        if (!t->size[i].pixels) continue;
+        size += t->size[i].w * t->size[i].h * 4;
+        free(t->size[i].pixels);
+        t->size[i].pixels = NULL;
+     }
+   return size;
+}
+
+static void
+_contact_thumb_free(Contact_Thumb *t)
+{
+   _contact_thumb_pixels_free(t);
+   eina_stringshare_del(t->jid);
+   eina_stringshare_del(t->sha1);
+   free(t);
+}
+
+/* decodes photo close to sz pixels and scales it to fit in sz x sz */
+static Eina_Bool
+_contact_thumb_scale(Contact_Thumb *t, Evas *e, const void *photo, size_t size, Eina_Bool grid)
+{
+   Evas_Object *img;
+   const unsigned int *src;
+   unsigned int *dst;
+   int sw, sh, stride, w, h, x, y, sz = contact_thumb_sizes[grid];
+
+   img = evas_object_image_add(e);
+   evas_object_image_load_size_set(img, sz, sz);
+   evas_object_image_memfile_set(img, (void*)photo, size, NULL, NULL);
+   evas_object_image_size_get(img, &sw, &sh);
+   src = evas_object_image_data_get(img, EINA_FALSE);
+   if ((evas_object_image_load_error_get(img) != EVAS_LOAD_ERROR_NONE) || (!src) || (sw < 1) || (sh < 1))
+     {
+        evas_object_del(img);
+        return EINA_FALSE;
+     }
+   stride = evas_object_image_stride_get(img) / 4;
+   if (stride < sw) stride = sw;
+
+   if ((sw <= sz) && (sh <= sz))
+     w = sw, h = sh;
+   else if (sw > sh)
+     w = sz, h = (sh * sz + sw / 2) / sw;
+   else
+     h = sz, w = (sw * sz + sh / 2) / sh;
+   if (!w) w = 1;
+   if (!h) h = 1;
+
+   dst = malloc(w * h * 4);
+   for (y = 0; y < h; y++)
+     {
+        const unsigned int *row = src + (y * sh / h) * stride;
+
+        for (x = 0; x < w; x++)
+          dst[y * w + x] = row[x * sw / w];
+     }
+   evas_object_del(img);
+
+   t->size[grid].pixels = dst;
+   t->size[grid].w = w;
+   t->size[grid].h = h;
+   return EINA_TRUE;
+}
+
+static void
+_contact_thumb_trim(Contact_List *cl)
+{
+   while ((cl->thumbs.size > CONTACT_THUMB_BUDGET) && cl->thumbs.lru)
+     {
+        Contact_Thumb *t = EINA_INLIST_CONTAINER_GET(cl->thumbs.lru, Contact_Thumb);
+
+        cl->thumbs.size -= _contact_thumb_pixels_free(t);
+        cl->thumbs.lru = eina_inlist_remove(cl->thumbs.lru, EINA_INLIST_GET(t));
+        eina_hash_del_by_key(cl->thumbs.hash, t->jid);
+     }
+}
+
+/* returns an image object showing c's avatar at the current mode's size */
+Evas_Object *
+contact_thumb_get(Contact_List *cl, Contact *c, Evas_Object *obj)
+{
+   Contact_Thumb *t;
+   Evas_Object *img;
+   const void *photo;
+   size_t size;
+   Eina_Bool grid = cl->mode;
+
+   if (!c->info) return NULL;
+   photo = shotgun_user_info_photo_get(c->info, &size);
+   if (!photo) return NULL;
+
+   if (!cl->thumbs.hash) cl->thumbs.hash = eina_hash_stringshared_new((Eina_Free_Cb)_contact_thumb_free);
+   t = eina_hash_find(cl->thumbs.hash, c->base->jid);
+   if (t)
+     {
+        cl->thumbs.lru = eina_inlist_demote(cl->thumbs.lru, EINA_INLIST_GET(t));
+        if (t->sha1 != c->info->photo.sha1)
+          {  /* new avatar */
+             cl->thumbs.size -= _contact_thumb_pixels_free(t);
+             eina_stringshare_replace(&t->sha1, c->info->photo.sha1);
+             t->failed = EINA_FALSE;
+          }
+     }
+   else
+     {
+        t = calloc(1, sizeof(Contact_Thumb));
+        t->jid = eina_stringshare_ref(c->base->jid);
+        t->sha1 = eina_stringshare_ref(c->info->photo.sha1);
+        eina_hash_direct_add(cl->thumbs.hash, t->jid, t);
+        cl->thumbs.lru = eina_inlist_append(cl->thumbs.lru, EINA_INLIST_GET(t));
+     }
+   if (t->failed) return NULL; /* until the avatar changes */
+   if (!t->size[grid].pixels)
+     {
+        if (!_contact_thumb_scale(t, evas_object_evas_get(obj), photo, size, grid))
+          {
+             ERR("Could not load avatar for %s", c->base->jid);
+             t->failed = EINA_TRUE;
+             return NULL;
+          }
+        cl->thumbs.size += t->size[grid].w * t->size[grid].h * 4;
+        DBG("Avatar thumbnail for %s: %dx%d", c->base->jid, t->size[grid].w, t->size[grid].h);
+     }
+
+   img = evas_object_image_filled_add(evas_object_evas_get(obj));
+   evas_object_image_alpha_set(img, EINA_TRUE);
+   evas_object_image_size_set(img, t->size[grid].w, t->size[grid].h);
+   evas_object_image_data_copy_set(img, t->size[grid].pixels);
+   evas_object_image_data_update_add(img, 0, 0, t->size[grid].w, t->size[grid].h);
+   evas_object_size_hint_aspect_set(img, EVAS_ASPECT_CONTROL_VERTICAL, t->size[grid].w, t->size[grid].h);
+   evas_object_size_hint_min_set(img, t->size[grid].w, t->size[grid].h);
+   /* t itself may go here, but the pixels are already copied */
+   _contact_thumb_trim(cl);
+   return img;
+}
+
+void
+contact_thumbs_free(Contact_List *cl)
+{
+   if (!cl->thumbs.hash) return;
+   eina_hash_free(cl->thumbs.hash);
+   cl->thumbs.hash = NULL;
+   cl->thumbs.lru = NULL;
+   cl->thumbs.size = 0;
+}
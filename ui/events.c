@@ -1,5 +1,29 @@
 #include "ui.h"
 
+static Eina_Bool
+_event_connect_offline_cb(const Eina_Hash *hash __UNUSED__, const void *key __UNUSED__, Contact *c, void *fdata __UNUSED__)
+{
+   Shotgun_Event_Presence *pres;
+
+   EINA_LIST_FREE(c->plist, pres)
+     shotgun_event_presence_free(pres);
+   if (c->cur) contact_list_user_del(c, NULL);
+   c->status = SHOTGUN_USER_STATUS_NONE;
+   c->description = NULL;
+   return EINA_TRUE;
+}
+
+/* a new session after a reconnect: presences from the old one no longer hold,
+ * the server sends current ones after ours
+ */
+Eina_Bool
+event_connect_cb(Contact_List *cl, int type __UNUSED__, Shotgun_Auth *auth)
+{
+   if (auth != cl->account) return ECORE_CALLBACK_PASS_ON;
+   eina_hash_foreach(cl->users, (Eina_Hash_Foreach)_event_connect_offline_cb, NULL);
+   return ECORE_CALLBACK_RENEW;
+}
+
 Eina_Bool
 event_iq_cb(Contact_List *cl, int type __UNUSED__, Shotgun_Event_Iq *ev)
 {
@@ -103,10 +127,16 @@ event_presence_cb(Contact_List *cl, int type __UNUSED__, Shotgun_Event_Presence
         if (!c->list_item)
           {
              contact_list_user_add(cl, c);
-             if (ev->vcard) shotgun_iq_vcard_get(ev->account, c->base->jid);
+             if (ev->vcard) shotgun_iq_vcard_get_cached(ev->account, c->base->jid, ev->photo);
           }
         else
-          cl->list_item_update[cl->mode](c->list_item);
+          {
+             /* avatar changed since it was fetched */
+             if (ev->vcard && ev->photo && ev->photo[0] && c->info && c->info->photo.sha1 &&
+                 strcasecmp(ev->photo, c->info->photo.sha1))
+               shotgun_iq_vcard_get_cached(ev->account, c->base->jid, ev->photo);
+             cl->list_item_update[cl->mode](c->list_item);
+          }
      }
    return EINA_TRUE;
 }
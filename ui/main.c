@@ -5,9 +5,13 @@ int ui_log_dom = -1;
 static Eina_Bool
 con(void *d __UNUSED__, int type __UNUSED__, Shotgun_Auth *auth)
 {
-   shotgun_iq_roster_get(auth);
-   shotgun_presence_set(auth, SHOTGUN_USER_STATUS_CHAT, "testing SHOTGUN!", 1);
-   shotgun_presence_send(auth);
+   static Eina_Bool started;
+
+   /* roster and presence went out with the bind.
+    * after a reconnect the contact list is still around
+    */
+   if (started) return ECORE_CALLBACK_RENEW;
+   started = EINA_TRUE;
    contact_list_new(auth);
    return ECORE_CALLBACK_RENEW;
 }
@@ -64,6 +68,9 @@ main(int argc, char *argv[])
         return 1;
      }
    shotgun_password_set(auth, pass);
+   if (getenv("SHOTGUN_DIRECT_TLS")) shotgun_direct_tls_set(auth, EINA_TRUE);
+   shotgun_presence_set(auth, SHOTGUN_USER_STATUS_CHAT, "testing SHOTGUN!", 1);
+   shotgun_login_pipeline_set(auth, EINA_TRUE);
    shotgun_gchat_connect(auth);
    ecore_main_loop_begin();
 
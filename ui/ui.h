@@ -1,6 +1,7 @@
 #ifndef __UI_H
 #define __UI_H
 
+#include <stdint.h>
 #include <Shotgun.h>
 #include <Ecore.h>
 #include <Ecore_Con.h>
@@ -23,6 +24,32 @@ extern int ui_log_dom;
 
 typedef struct Contact_List Contact_List;
 typedef struct Contact Contact;
+typedef struct Chat_Log Chat_Log;
+typedef struct Chat_Search Chat_Search;
+
+typedef void (*Chat_Log_Cb)(void *data, const char *msg, Eina_Bool me, time_t t);
+typedef void (*Chat_Log_Search_Cb)(void *data, const char *jid, const char *msg, Eina_Bool me, time_t t);
+
+typedef struct
+{
+   EINA_INLIST;
+   const char *jid;
+   const char *sha1;
+   struct
+     {
+        unsigned int *pixels; /* premultiplied ARGB */
+        int w, h;
+     } size[2]; /* list, grid */
+   Eina_Bool failed : 1; /* sha1's photo could not be decoded */
+} Contact_Thumb;
+
+typedef struct
+{
+   time_t time;
+   const char *from;
+   char *msg;
+   Eina_Bool me : 1;
+} Chat_Message;
 
 typedef void (*Contact_List_Item_Tooltip_Cb)(void *item, Elm_Tooltip_Item_Content_Cb func, const void *data, Evas_Smart_Cb del_cb);
 typedef Eina_Bool (*Contact_List_Item_Tooltip_Resize_Cb)(void *item, Eina_Bool set);
@@ -37,6 +64,11 @@ struct Contact_List
    Eina_Hash *users;
    Eina_Hash *user_convs;
    Eina_Hash *images;
+   Eina_Inlist *images_lru; /* least recently shown first */
+   size_t images_size; /* bytes of image data in memory */
+   Eina_List *images_queue; /* waiting to be fetched, next first */
+   unsigned int images_fetching;
+   Chat_Log *log;
    Ecore_Timer *status_timer;
 
    Eina_Bool mode : 1; /* 0 for list, 1 for grid */
@@ -48,10 +80,17 @@ struct Contact_List
    Contact_List_Item_Tooltip_Cb list_item_tooltip_add[2];
    Contact_List_Item_Tooltip_Resize_Cb list_item_tooltip_resize[2];
 
+   struct {
+        Eina_Hash *hash;
+        Eina_Inlist *lru; /* least recently used first */
+        size_t size; /* bytes of pixels */
+   } thumbs;
+
    struct {
         Ecore_Event_Handler *iq;
         Ecore_Event_Handler *presence;
         Ecore_Event_Handler *message;
+        Ecore_Event_Handler *connect;
    } event_handlers;
    Shotgun_Auth *account;
 };
@@ -65,7 +104,13 @@ struct Contact
    Eina_List *imgs;
    Shotgun_User_Status status;
    char *description;
-   const char *last_conv;
+   struct
+     {
+        Chat_Message *msgs; /* ring of CHAT_HISTORY_SIZE, allocated on first use */
+        unsigned int start, count;
+        unsigned int shown; /* messages in chat_buffer */
+        time_t oldest; /* of the first one of those */
+     } history;
    const char *tooltip_label;
    void *list_item;
    Evas_Object *chat_window;
@@ -78,21 +123,53 @@ struct Contact
 
 typedef struct
 {
-   Ecore_Con_Url *url;
-   Eina_Binbuf *buf;
+   EINA_INLIST;
+   Ecore_Con_Url *url; /* only while queued or fetching */
+   const char *addr;
+   unsigned char *data;
+   size_t len, alloc;
+   size_t total; /* Content-Length, 0 if unknown */
+   char *spill; /* file holding the image once evicted from memory */
    Contact_List *cl;
+   Evas_Object *win; /* chat window that wants it */
+   Evas_Object *anchor; /* entry whose tooltip shows it */
+   Evas_Object *progress; /* placeholder in that tooltip during the transfer */
+   Eina_Bool fetching : 1;
+   Eina_Bool done : 1;
+   Eina_Bool rejected : 1; /* not an image, or too large */
 } Image;
 
 void contact_list_new(Shotgun_Auth *auth);
 void contact_list_user_add(Contact_List *cl, Contact *c);
 void contact_list_user_del(Contact *c, Shotgun_Event_Presence *ev);
 
+Evas_Object *contact_thumb_get(Contact_List *cl, Contact *c, Evas_Object *obj);
+void contact_thumbs_free(Contact_List *cl);
+
 void chat_window_new(Contact *c);
 void chat_message_status(Contact *c, Shotgun_Event_Message *msg);
 void chat_message_insert(Contact *c, const char *from, const char *msg, Eina_Bool me);
-
-
-void char_image_add(Contact_List *cl, const char *url);
+void chat_history_free(Contact *c);
+
+Chat_Log *chat_log_new(const char *account);
+void chat_log_free(Chat_Log *log);
+void chat_log_append(Chat_Log *log, const char *jid, const char *msg, Eina_Bool me, time_t t);
+unsigned int chat_log_page(Chat_Log *log, const char *jid, time_t before, unsigned int max, Chat_Log_Cb cb, void *data);
+unsigned int chat_log_search(Chat_Log *log, const char *query, unsigned int max, Chat_Log_Search_Cb cb, void *data);
+
+Chat_Search *chat_search_new(const char *path);
+void chat_search_reset(Chat_Search *s);
+void chat_search_free(Chat_Search *s);
+void chat_search_add(Chat_Search *s, uint64_t offset, uint64_t end, const char *msg, size_t len);
+uint64_t chat_search_end_get(Chat_Search *s);
+Eina_Binbuf *chat_search_segment_get(Chat_Search *s, Eina_Bool *full);
+int chat_search_segment_write(Chat_Search *s, Eina_Binbuf *buf, Eina_Bool full);
+void chat_search_segment_lost(Chat_Search *s);
+unsigned int chat_search_query(Chat_Search *s, const char *query, uint64_t *offsets, unsigned int max);
+
+
+Image *char_image_add(Contact_List *cl, const char *url, Evas_Object *win);
+void chat_image_window_cancel(Contact_List *cl, Evas_Object *win);
 void chat_image_free(Image *i);
 void chat_conv_image_show(Evas_Object *convo, Evas_Object *obj, Elm_Entry_Anchor_Info *ev);
 void chat_conv_image_hide(Evas_Object *convo __UNUSED__, Evas_Object *obj, Elm_Entry_Anchor_Info *ev);
@@ -102,6 +179,7 @@ Eina_Bool chat_image_complete(void *d __UNUSED__, int type __UNUSED__, Ecore_Con
 void contact_free(Contact *c);
 void do_something_with_user(Contact_List *cl, Shotgun_User *user);
 
+Eina_Bool event_connect_cb(Contact_List *cl, int type __UNUSED__, Shotgun_Auth *auth);
 Eina_Bool event_iq_cb(Contact_List *cl, int type __UNUSED__, Shotgun_Event_Iq *ev);
 Eina_Bool event_presence_cb(Contact_List *cl, int type __UNUSED__, Shotgun_Event_Presence *ev);
 Eina_Bool event_message_cb(void *data, int type __UNUSED__, void *event);
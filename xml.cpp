@@ -8,80 +8,225 @@
 #define XML_NS_DISCO_INFO "http://jabber.org/protocol/disco#info"
 #define XML_NS_CHATSTATES "http://jabber.org/protocol/chatstates"
 #define XML_NS_BIND "urn:ietf:params:xml:ns:xmpp-bind"
+#define XML_NS_SM "urn:xmpp:sm:3"
+#define XML_NS_SASL "urn:ietf:params:xml:ns:xmpp-sasl"
 
 using namespace pugi;
 
-struct xml_memory_writer : xml_writer
+/* pugixml allocates at least one 32k page for every document it builds or parses.
+ * stanzas are instead handled out of per-connection blocks which are
+ * rewound, but never freed, once the stanza is done with.
+ */
+#define XML_ARENA_BLOCK_SIZE (128 * 1024)
+
+struct xml_arena_block
+{
+   xml_arena_block *next;
+   size_t size;
+   size_t used;
+   double data[1]; /* for alignment */
+};
+
+struct xml_parse_context
+{
+   xml_document doc;
+   xml_arena_block *blocks;
+   xml_arena_block *cur;
+   unsigned int active;
+};
+
+static xml_parse_context *xml_arena = NULL;
+
+static void *
+xml_arena_alloc(size_t size)
+{
+   xml_arena_block *b;
+
+   if (!xml_arena) return malloc(size);
+
+   size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+   for (b = xml_arena->cur; b; b = b->next)
+     {
+        if (b->used + size <= b->size) break;
+        if (b->next) b->next->used = 0;
+     }
+   if (!b)
+     {
+        size_t bsize = size > XML_ARENA_BLOCK_SIZE ? size : XML_ARENA_BLOCK_SIZE;
+
+        b = static_cast<xml_arena_block*>(malloc(offsetof(xml_arena_block, data) + bsize));
+        if (!b) return NULL;
+        DBG("Growing parse arena by %zu bytes", bsize);
+        b->size = bsize;
+        b->used = 0;
+        b->next = NULL;
+        if (xml_arena->cur)
+          {
+             xml_arena_block *last;
+
+             for (last = xml_arena->cur; last->next; last = last->next) ;
+             last->next = b;
+          }
+        else
+          xml_arena->blocks = b;
+     }
+   xml_arena->cur = b;
+   b->used += size;
+   return reinterpret_cast<char*>(b->data) + b->used - size;
+}
+
+static void
+xml_arena_free(void *ptr)
 {
-   char  *buffer;
-   size_t capacity;
+   xml_arena_block *b;
 
-   size_t result;
+   if (xml_arena)
+     {
+        for (b = xml_arena->blocks; b; b = b->next)
+          if ((ptr >= (void*)b->data) && (ptr < (void*)(reinterpret_cast<char*>(b->data) + b->size)))
+            return; /* reclaimed by xml_arena_scope */
+     }
+   free(ptr);
+}
 
-   xml_memory_writer() : buffer(0), capacity(0), result(0)
+/* makes auth's arena the pugixml allocator for its lifetime */
+struct xml_arena_scope
+{
+   xml_parse_context *ctx;
+
+   xml_arena_scope(Shotgun_Auth *auth)
    {
+      if (!auth->parse)
+        {
+           ctx = new xml_parse_context;
+           ctx->blocks = ctx->cur = NULL;
+           ctx->active = 0;
+           auth->parse = ctx;
+        }
+      else
+        ctx = static_cast<xml_parse_context*>(auth->parse);
+      ctx->active++;
+      xml_arena = ctx;
    }
 
-   xml_memory_writer(char  *buffer,
-                     size_t capacity) : buffer(buffer), capacity(capacity), result(0)
+   ~xml_arena_scope()
    {
+      if (--ctx->active) return;
+      ctx->doc.reset();
+      ctx->cur = ctx->blocks;
+      if (ctx->cur) ctx->cur->used = 0;
+      xml_arena = NULL;
    }
+};
+
+void
+xml_init(void)
+{
+   set_memory_management_functions(xml_arena_alloc, xml_arena_free);
+}
 
-   size_t
-   written_size() const
+struct xml_strbuf_writer : xml_writer
+{
+   Eina_Strbuf *buf;
+
+   xml_strbuf_writer(Eina_Strbuf *buf) : buf(buf)
    {
-      return result < capacity ? result : capacity;
    }
 
    virtual void
    write(const void *data,
          size_t      size)
    {
-      if (result < capacity)
-        {
-           size_t chunk = (capacity - result < size) ? capacity - result : size;
-           memcpy(buffer + result, data, chunk);
-        }
-
-      result += size;
+      eina_strbuf_append_length(buf, static_cast<const char*>(data), size);
    }
 };
 
-static char *
-xmlnode_to_buf(xml_node node,
+static void
+xml_escape_append(Eina_Strbuf *buf, const char *str)
+{
+   const char *p;
+
+   for (p = str; *p; p++)
+     {
+        const char *rep;
+
+        switch (*p)
+          {
+           case '&':
+             rep = "&amp;";
+             break;
+           case '<':
+             rep = "&lt;";
+             break;
+           case '>':
+             rep = "&gt;";
+             break;
+           case '"':
+             rep = "&quot;";
+             break;
+           case '\'':
+             rep = "&apos;";
+             break;
+           default:
+             continue;
+          }
+        eina_strbuf_append_length(buf, str, p - str);
+        eina_strbuf_append(buf, rep);
+        str = p + 1;
+     }
+   eina_strbuf_append_length(buf, str, p - str);
+}
+
+/* returns auth's output buffer, emptied for the next stanza */
+static Eina_Strbuf *
+xml_buf_get(Shotgun_Auth *auth)
+{
+   if (!auth->xmlbuf) auth->xmlbuf = eina_strbuf_new();
+   else eina_strbuf_reset(auth->xmlbuf);
+   return auth->xmlbuf;
+}
+
+#define XML_APPEND_LITERAL(BUF, STR) \
+  eina_strbuf_append_length((BUF), STR, sizeof(STR) - 1)
+
+/* serializes node into auth's output buffer in a single pass.
+ * the returned string is owned by auth and valid until the next call.
+ * leave_open writes only node's start tag, as for <stream:stream>
+ */
+static const char *
+xmlnode_to_buf(Shotgun_Auth *auth,
+               xml_node node,
                size_t *len,
                Eina_Bool leave_open)
 {
-   xml_memory_writer counter;
-   char *buffer;
+   xml_buf_get(auth);
 
-   node.print(counter);
-   buffer = static_cast<char*>(calloc(1, counter.result ));
-   xml_memory_writer writer(buffer, counter.result);
-   node.print(writer);
-   buffer[writer.written_size() - 1] = 0;
    if (leave_open)
      {
-        if (buffer[writer.written_size() - 4] == ' ')
+        eina_strbuf_append_char(auth->xmlbuf, '<');
+        eina_strbuf_append(auth->xmlbuf, node.name());
+        for (xml_attribute attr = node.first_attribute(); attr; attr = attr.next_attribute())
           {
-             buffer[writer.written_size() - 4] = '>';
-             buffer[writer.written_size() - 3] = 0;
-             *len = writer.written_size() - 2;
-          }
-        else
-          {
-             buffer[writer.written_size() - 3] = '>';
-             buffer[writer.written_size() - 2] = 0;
-             *len = writer.written_size() - 1;
+             eina_strbuf_append_char(auth->xmlbuf, ' ');
+             eina_strbuf_append(auth->xmlbuf, attr.name());
+             eina_strbuf_append_length(auth->xmlbuf, "=\"", 2);
+             xml_escape_append(auth->xmlbuf, attr.value());
+             eina_strbuf_append_char(auth->xmlbuf, '"');
           }
+        eina_strbuf_append_char(auth->xmlbuf, '>');
      }
    else
-     *len = writer.written_size();
+     {
+        xml_strbuf_writer writer(auth->xmlbuf);
+
+        node.print(writer, PUGIXML_TEXT(""), format_raw);
+     }
 
-   return buffer;
+   *len = eina_strbuf_length_get(auth->xmlbuf);
+   return eina_strbuf_string_get(auth->xmlbuf);
 }
 
-char *
+const char *
 xml_stream_init_create(Shotgun_Auth *auth, const char *lang, size_t *len)
 {
 /*
@@ -93,6 +238,7 @@ C: <stream:stream
      xmlns='jabber:client'
      xmlns:stream='http://etherx.jabber.org/streams'>
 */
+   xml_arena_scope scope(auth);
    xml_document doc;
    xml_node stream;
 
@@ -104,13 +250,14 @@ C: <stream:stream
    stream.append_attribute("xmlns").set_value("jabber:client");
    stream.append_attribute("xmlns:stream").set_value("http://etherx.jabber.org/streams");
 
-   return xmlnode_to_buf(stream, len, EINA_TRUE);
+   return xmlnode_to_buf(auth, stream, len, EINA_TRUE);
 }
 
 static Eina_Bool
 xml_stream_init_read_mechanisms(Shotgun_Auth *auth, xml_node stream, xml_node node)
 {
   xml_attribute attr;
+  xml_node it;
 /*
 S: <stream:features>
      <starttls xmlns="urn:ietf:params:xml:ns:xmpp-tls">
@@ -136,6 +283,15 @@ S: <stream:features>
              auth->features.sasl = EINA_TRUE;
            break;
         }
+   for (it = node.child("mechanism"); it; it = it.next_sibling("mechanism"))
+     {
+        if (!strcmp(it.child_value(), "PLAIN"))
+          auth->features.mechs |= SHOTGUN_SASL_MECH_PLAIN;
+        else if (!strcmp(it.child_value(), "SCRAM-SHA-1"))
+          auth->features.mechs |= SHOTGUN_SASL_MECH_SCRAM_SHA_1;
+        else if (!strcmp(it.child_value(), "SCRAM-SHA-256"))
+          auth->features.mechs |= SHOTGUN_SASL_MECH_SCRAM_SHA_256;
+     }
    /* lots more auth mechanisms here but who cares */
    return EINA_TRUE;
 }
@@ -153,7 +309,8 @@ S: <stream:stream
      xmlns='jabber:client'
      xmlns:stream='http://etherx.jabber.org/streams'>
 */
-   xml_document doc;
+   xml_arena_scope scope(auth);
+   xml_document &doc = scope.ctx->doc;
    xml_node stream, node;
    xml_attribute attr;
    xml_parse_result res;
@@ -185,6 +342,11 @@ S: <stream:stream
    if (!node.empty())
      return xml_stream_init_read_mechanisms(auth, stream, node);
 
+   if (!stream.child("ver").empty())
+     auth->features.rosterver = EINA_TRUE;
+   if (!strcmp(stream.child("sm").attribute("xmlns").value(), XML_NS_SM))
+     auth->features.sm = EINA_TRUE;
+
    node = stream.child("bind");
    /* something something */
    return EINA_TRUE;
@@ -203,8 +365,12 @@ S: <failure xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>
    return xml[1] == 'p';
 }
 
-char *
-xml_sasl_write(const char *sasl, size_t *len)
+#define XML_SASL_GOOGLE \
+  " xmlns:ga='http://www.google.com/talk/protocol/auth'" \
+  " ga:client-uses-full-bind-result='true'"
+
+const char *
+xml_sasl_write(Shotgun_Auth *auth, const char *mech, const void *data, size_t size, size_t *len)
 {
 /*
 http://code.google.com/apis/talk/jep_extensions/jid_domain_change.html
@@ -215,38 +381,191 @@ http://code.google.com/apis/talk/jep_extensions/jid_domain_change.html
 ... encoded user name and password ... user=example@gmail.com password=supersecret
 </auth>
 */
-   xml_document doc;
-   xml_node auth;
+   Shotgun_Base64 b64 = { { 0 }, 0 };
+   Eina_Strbuf *buf;
+
+   buf = xml_buf_get(auth);
+   eina_strbuf_append_printf(buf, "<auth xmlns='" XML_NS_SASL "' mechanism='%s'", mech);
+   /* only google cares */
+   if (!strcmp(mech, "PLAIN")) XML_APPEND_LITERAL(buf, XML_SASL_GOOGLE);
+   eina_strbuf_append_char(buf, '>');
+   shotgun_base64_encode_append(&b64, buf, data, size);
+   shotgun_base64_encode_end(&b64, buf);
+   XML_APPEND_LITERAL(buf, "</auth>");
+
+   *len = eina_strbuf_length_get(buf);
+   return eina_strbuf_string_get(buf);
+}
+
+const char *
+xml_sasl_response_write(Shotgun_Auth *auth, const void *data, size_t size, size_t *len)
+{
+/*
+C: <response xmlns="urn:ietf:params:xml:ns:xmpp-sasl">
+   Yz1iaXdzLHI9ZmN5...
+   </response>
+*/
+   Shotgun_Base64 b64 = { { 0 }, 0 };
+   Eina_Strbuf *buf;
 
-   auth = doc.append_child("auth");
-   auth.append_attribute("xmlns").set_value("urn:ietf:params:xml:ns:xmpp-sasl");
-   auth.append_attribute("mechanism").set_value("PLAIN");
-   auth.append_attribute("xmlns:ga").set_value("http://www.google.com/talk/protocol/auth");
-   auth.append_attribute("ga:client-uses-full-bind-result").set_value("true");
-   auth.append_child(node_pcdata).set_value(sasl);
+   buf = xml_buf_get(auth);
+   XML_APPEND_LITERAL(buf, "<response xmlns='" XML_NS_SASL "'>");
+   shotgun_base64_encode_append(&b64, buf, data, size);
+   shotgun_base64_encode_end(&b64, buf);
+   XML_APPEND_LITERAL(buf, "</response>");
 
-   return xmlnode_to_buf(auth, len, EINA_FALSE);
+   *len = eina_strbuf_length_get(buf);
+   return eina_strbuf_string_get(buf);
 }
 
-Eina_Bool
-xml_sasl_read(const unsigned char *xml, size_t size __UNUSED__)
+/* data is set to the decoded content, if any, which must be freed */
+Shotgun_Sasl_Type
+xml_sasl_read(Shotgun_Auth *auth, char *xml, size_t size, char **data, size_t *data_size)
 {
 /*
-S: <success xmlns="urn:ietf:params:xml:ns:xmpp-sasl"/>
+S: <challenge xmlns="urn:ietf:params:xml:ns:xmpp-sasl">
+   cj1mY3lEYXZlc...
+   </challenge>
+
+S: <success xmlns="urn:ietf:params:xml:ns:xmpp-sasl">
+   dj1wTk5ERlZFUXh1WHhDb1NFaVc4R0VaKzFSU289
+   </success>
 
-S: <failure xmlns="urn:ietf:params:xml:ns:xmpp-sasl"><not-authorized/></failure
+S: <failure xmlns="urn:ietf:params:xml:ns:xmpp-sasl"><not-authorized/></failure>
 */
-   /* I don't even care at this point */
-   return xml[1] == 's';
+   xml_arena_scope scope(auth);
+   xml_document &doc = scope.ctx->doc;
+   xml_node node;
+   xml_parse_result res;
+   Shotgun_Sasl_Type type;
+   const char *name, *text;
+   ssize_t n;
+
+   *data = NULL;
+   *data_size = 0;
+   res = doc.load_buffer_inplace(xml, size, parse_default, encoding_auto);
+   if (res.status != status_ok)
+     {
+        ERR("%s", res.description());
+        return SHOTGUN_SASL_UNKNOWN;
+     }
+   node = doc.first_child();
+   if (strcmp(node.attribute("xmlns").value(), XML_NS_SASL)) return SHOTGUN_SASL_UNKNOWN;
+   name = node.name();
+   if (!strcmp(name, "failure"))
+     {
+        ERR("SASL failure: %s", node.first_child().name());
+        return SHOTGUN_SASL_FAILURE;
+     }
+   if (!strcmp(name, "challenge")) type = SHOTGUN_SASL_CHALLENGE;
+   else if (!strcmp(name, "success")) type = SHOTGUN_SASL_SUCCESS;
+   else return SHOTGUN_SASL_UNKNOWN;
+
+   text = node.child_value();
+   size = strlen(text);
+   if (size && strcmp(text, "="))
+     {
+        *data = static_cast<char*>(malloc((size + 3) / 4 * 3 + 1));
+        n = shotgun_base64_decode_buf(text, size, reinterpret_cast<unsigned char*>(*data));
+        if (n < 0)
+          {
+             ERR("Undecodable SASL data");
+             free(*data);
+             *data = NULL;
+             return SHOTGUN_SASL_FAILURE;
+          }
+        (*data)[n] = 0;
+        *data_size = n;
+     }
+   return type;
+}
+
+Shotgun_Sm_Type
+xml_sm_read(Shotgun_Auth *auth, char *xml, size_t size, unsigned int *h)
+{
+/*
+S: <enabled xmlns='urn:xmpp:sm:3' id='some-long-sm-id' resume='true' max='300'/>
+S: <r xmlns='urn:xmpp:sm:3'/>
+S: <a xmlns='urn:xmpp:sm:3' h='1'/>
+S: <resumed xmlns='urn:xmpp:sm:3' h='another-sequence-number' previd='some-long-sm-id'/>
+S: <failed xmlns='urn:xmpp:sm:3' h='another-sequence-number'>
+     <item-not-found xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/>
+   </failed>
+*/
+   xml_arena_scope scope(auth);
+   xml_document &doc = scope.ctx->doc;
+   xml_node node;
+   xml_attribute attr;
+   xml_parse_result res;
+   const char *name;
+
+   res = doc.load_buffer_inplace(xml, size, parse_default, encoding_auto);
+   if (res.status != status_ok)
+     {
+        ERR("%s", res.description());
+        return SHOTGUN_SM_UNKNOWN;
+     }
+   node = doc.first_child();
+   if (strcmp(node.attribute("xmlns").value(), XML_NS_SM)) return SHOTGUN_SM_UNKNOWN;
+
+   /* h is left alone if it isn't there */
+   attr = node.attribute("h");
+   if (!attr.empty()) *h = strtoul(attr.value(), NULL, 10);
+   name = node.name();
+   if (!strcmp(name, "r")) return SHOTGUN_SM_REQUEST;
+   if (!strcmp(name, "a")) return SHOTGUN_SM_ACK;
+   if (!strcmp(name, "resumed")) return SHOTGUN_SM_RESUMED;
+   if (!strcmp(name, "failed")) return SHOTGUN_SM_FAILED;
+   if (strcmp(name, "enabled")) return SHOTGUN_SM_UNKNOWN;
+
+   attr = node.attribute("resume");
+   if ((!strcmp(attr.value(), "true")) || (!strcmp(attr.value(), "1")))
+     eina_stringshare_replace(&auth->sm.id, node.attribute("id").value());
+   else
+     eina_stringshare_replace(&auth->sm.id, NULL);
+   auth->sm.max = strtoul(node.attribute("max").value(), NULL, 10);
+   return SHOTGUN_SM_ENABLED;
+}
+
+const char *
+xml_sm_ack_write(Shotgun_Auth *auth, size_t *len)
+{
+/*
+C: <a xmlns='urn:xmpp:sm:3' h='1'/>
+*/
+   Eina_Strbuf *buf;
+
+   buf = xml_buf_get(auth);
+   eina_strbuf_append_printf(buf, "<a xmlns='" XML_NS_SM "' h='%u'/>", auth->sm.in);
+   *len = eina_strbuf_length_get(buf);
+   return eina_strbuf_string_get(buf);
 }
 
-char *
-xml_iq_write_preset(Shotgun_Auth *auth, Shotgun_Iq_Preset p, size_t *len)
+const char *
+xml_sm_resume_write(Shotgun_Auth *auth, size_t *len)
 {
+/*
+C: <resume xmlns='urn:xmpp:sm:3' h='some-sequence-number' previd='some-long-sm-id'/>
+*/
+   Eina_Strbuf *buf;
+
+   buf = xml_buf_get(auth);
+   eina_strbuf_append_printf(buf, "<resume xmlns='" XML_NS_SM "' h='%u' previd='", auth->sm.in);
+   xml_escape_append(buf, auth->sm.id);
+   XML_APPEND_LITERAL(buf, "'/>");
+   *len = eina_strbuf_length_get(buf);
+   return eina_strbuf_string_get(buf);
+}
+
+const char *
+xml_iq_write_preset(Shotgun_Auth *auth, Shotgun_Iq_Preset p, const char *id, size_t *len)
+{
+   xml_arena_scope scope(auth);
    xml_document doc;
    xml_node iq, node;
 
    iq = doc.append_child("iq");
+   iq.append_attribute("id").set_value(id);
    switch (p)
      {
       case SHOTGUN_IQ_PRESET_BIND:
@@ -260,7 +579,6 @@ xml_iq_write_preset(Shotgun_Auth *auth, Shotgun_Iq_Preset p, size_t *len)
 </iq>
 */
         iq.append_attribute("type").set_value("set");
-        iq.append_attribute("id").set_value("0");
 
         node = iq.append_child("bind");
         node.append_attribute("xmlns").set_value("urn:ietf:params:xml:ns:xmpp-bind");
@@ -275,19 +593,22 @@ xml_iq_write_preset(Shotgun_Auth *auth, Shotgun_Iq_Preset p, size_t *len)
 </iq>
 */
         iq.append_attribute("type").set_value("get");
-        iq.append_attribute("id").set_value("roster");
 
         node = iq.append_child("query");
         node.append_attribute("xmlns").set_value(XML_NS_ROSTER);
+        /* XEP-0237: an empty ver asks for versioning without having a roster stored */
+        if (auth->features.rosterver)
+          node.append_attribute("ver").set_value(auth->roster.ver ? auth->roster.ver : "");
       default:
         break;
      }
-   return xmlnode_to_buf(doc, len, EINA_FALSE);
+   return xmlnode_to_buf(auth, doc, len, EINA_FALSE);
 }
 
-char *
-xml_iq_write_get_vcard(const char *to, size_t *len)
+const char *
+xml_iq_write_get_vcard(Shotgun_Auth *auth, const char *to, const char *id, size_t *len)
 {
+   xml_arena_scope scope(auth);
    xml_document doc;
    xml_node iq;
    iq = doc.append_child("iq");
@@ -299,18 +620,11 @@ xml_iq_write_get_vcard(const char *to, size_t *len)
   <vCard xmlns='vcard-temp'/>
 </iq>
 */
-   if (to)
-     {
-        const char *s;
-        char buf[256];
-        s = strrchr(to, '/');
-        if (s) strncat(buf, to, s - to);
-        iq.append_attribute("to").set_value(s ? buf : to);
-     }
-   iq.append_attribute("id").set_value("vcard-get");
+   if (to) iq.append_attribute("to").set_value(to);
+   iq.append_attribute("id").set_value(id);
    iq.append_attribute("type").set_value("get");
    iq.append_child("vCard").append_attribute("xmlns").set_value("vcard-temp");
-   return xmlnode_to_buf(doc, len, EINA_FALSE);
+   return xmlnode_to_buf(auth, doc, len, EINA_FALSE);
 }
 
 static Shotgun_Iq_Type
@@ -328,6 +642,30 @@ xml_iq_type_get(xml_node node)
    return SHOTGUN_IQ_TYPE_ERROR;
 }
 
+static Shotgun_Iq_Error
+xml_iq_error_get(xml_node node)
+{
+/*
+<iq type='error' id='v3'>
+  <error type='cancel'>
+    <service-unavailable xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/>
+  </error>
+</iq>
+*/
+   const char *type;
+
+   type = node.child("error").attribute("type").value();
+   if (!strcmp(type, "auth"))
+     return SHOTGUN_IQ_ERROR_AUTH;
+   if (!strcmp(type, "continue"))
+     return SHOTGUN_IQ_ERROR_CONTINUE;
+   if (!strcmp(type, "modify"))
+     return SHOTGUN_IQ_ERROR_MODIFY;
+   if (!strcmp(type, "wait"))
+     return SHOTGUN_IQ_ERROR_WAIT;
+   return SHOTGUN_IQ_ERROR_CANCEL;
+}
+
 static Shotgun_User_Subscription
 xml_iq_user_subscription_get(xml_node node)
 {
@@ -341,6 +679,8 @@ xml_iq_user_subscription_get(xml_node node)
         return SHOTGUN_USER_SUBSCRIPTION_FROM;
       case 'b':
         return SHOTGUN_USER_SUBSCRIPTION_BOTH;
+      case 'r':
+        return SHOTGUN_USER_SUBSCRIPTION_REMOVE;
       default:
         break;
      }
@@ -348,7 +688,7 @@ xml_iq_user_subscription_get(xml_node node)
 }
 
 static Shotgun_Event_Iq *
-xml_iq_roster_read(Shotgun_Auth *auth, xml_node node)
+xml_iq_roster_read(Shotgun_Auth *auth, xml_node node, Eina_Bool full)
 {
 /*
 <iq to='juliet@example.com/balcony' type='result' id='roster_1'>
@@ -371,11 +711,8 @@ xml_iq_roster_read(Shotgun_Auth *auth, xml_node node)
   </query>
 </iq>
 */
-   Shotgun_Event_Iq *ret;
-
-   ret = static_cast<Shotgun_Event_Iq*>(calloc(1, sizeof(Shotgun_Event_Iq)));
-   ret->type = SHOTGUN_IQ_EVENT_TYPE_ROSTER;
-   ret->account = auth;
+   Eina_List *users = NULL;
+   xml_attribute ver;
 
    for (xml_node it = node.first_child(); it; it = it.next_sibling())
      {
@@ -389,13 +726,34 @@ xml_iq_roster_read(Shotgun_Auth *auth, xml_node node)
           user->name = eina_stringshare_add(name);
         user->jid = eina_stringshare_add(it.attribute("jid").value());
         user->subscription = xml_iq_user_subscription_get(it);
-        ret->ev = eina_list_append((Eina_List*)ret->ev, (void*)user);
+        users = eina_list_append(users, (void*)user);
      }
-   return ret;
+   ver = node.attribute("ver");
+   return shotgun_roster_apply(auth, users, ver.empty() ? NULL : ver.value(), full);
 }
 
 static void
-xml_iq_disco_info_write(Shotgun_Auth *auth, xml_document &query)
+xml_iq_result_write(Shotgun_Auth *auth, xml_node query)
+{
+/*
+<iq type='result' id='a78b4q6ha463'/>
+*/
+   xml_arena_scope scope(auth);
+   xml_document doc;
+   xml_node iq;
+   const char *xml;
+   size_t len;
+
+   iq = doc.append_child("iq");
+   iq.append_attribute("type").set_value("result");
+   iq.append_attribute("id").set_value(query.attribute("id").value());
+
+   xml = xmlnode_to_buf(auth, doc, &len, EINA_FALSE);
+   shotgun_write(auth, xml, len);
+}
+
+static void
+xml_iq_disco_info_write(Shotgun_Auth *auth, xml_node query)
 {
 /*
 <iq type='get'
@@ -429,9 +787,10 @@ xml_iq_disco_info_write(Shotgun_Auth *auth, xml_document &query)
   </query>
 </iq>
 */
+   xml_arena_scope scope(auth);
    xml_document doc;
    xml_node iq, node, identity;
-   char *xml;
+   const char *xml;
    size_t len;
 
    /* TODO: this setup should probably be a macro or something if it gets reused */
@@ -448,9 +807,8 @@ xml_iq_disco_info_write(Shotgun_Auth *auth, xml_document &query)
    node.append_child("feature").append_attribute("var").set_value(XML_NS_DISCO_INFO); /* yay recursion */
    node.append_child("feature").append_attribute("var").set_value(XML_NS_CHATSTATES);
 
-   xml = xmlnode_to_buf(doc, &len, EINA_FALSE);
-   shotgun_write(auth->svr, xml, len);
-   free(xml);
+   xml = xmlnode_to_buf(auth, doc, &len, EINA_FALSE);
+   shotgun_write(auth, xml, len);
 }
 
 static Shotgun_Event_Iq *
@@ -484,7 +842,11 @@ xml_iq_vcard_read(Shotgun_Auth *auth, xml_node iq, xml_node node)
                   info->photo.type = NULL;
                   continue;
                }
-             info->photo.data = shotgun_base64_decode(n.child_value(), strlen(n.child_value()), &info->photo.size);
+             /* kept encoded until someone wants to look at it */
+             info->photo.size = strlen(n.child_value());
+             info->photo.data = malloc(info->photo.size);
+             memcpy(info->photo.data, n.child_value(), info->photo.size);
+             info->photo.encoded = EINA_TRUE;
           }
      }
    return ret;
@@ -492,47 +854,95 @@ xml_iq_vcard_read(Shotgun_Auth *auth, xml_node iq, xml_node node)
 }
 
 Shotgun_Event_Iq *
-xml_iq_read(Shotgun_Auth *auth, char *xml, size_t size)
+xml_iq_read(Shotgun_Auth *auth, char *xml, size_t size, Shotgun_Iq_Reply *reply)
 {
-   xml_document doc;
-   xml_node node;
+   xml_arena_scope scope(auth);
+   xml_document &doc = scope.ctx->doc;
+   xml_node iq, node;
    xml_parse_result res;
    Shotgun_Iq_Type type;
    const char *str;
 
+   reply->id[0] = 0;
+   reply->error = SHOTGUN_IQ_ERROR_NONE;
    res = doc.load_buffer_inplace(xml, size, parse_default, encoding_auto);
    if (res.status != status_ok)
      {
         ERR("%s", res.description());
         return NULL;
      }
-   type = xml_iq_type_get(doc.first_child());
-   node = doc.first_child().first_child();
+   iq = doc.first_child();
+   type = xml_iq_type_get(iq);
+   node = iq.first_child();
    str = node.attribute("xmlns").value();
    switch (type)
      {
+      case SHOTGUN_IQ_TYPE_ERROR:
+        reply->error = xml_iq_error_get(iq);
+        /* fall through */
       case SHOTGUN_IQ_TYPE_RESULT:
+        /* answers are matched to their requests by id */
+        eina_strlcpy(reply->id, iq.attribute("id").value(), sizeof(reply->id));
+        if (type == SHOTGUN_IQ_TYPE_ERROR) break;
         if (!strcmp(str, XML_NS_ROSTER))
-          return xml_iq_roster_read(auth, node);
+          return xml_iq_roster_read(auth, node, EINA_TRUE);
         if (!strcmp(str, "vcard-temp"))
-          return xml_iq_vcard_read(auth, doc.first_child(), node);
+          return xml_iq_vcard_read(auth, iq, node);
         if (!strcmp(str, XML_NS_BIND))
           auth->bind = eina_stringshare_add(node.child("jid").child_value());
-          break;
+        break;
       case SHOTGUN_IQ_TYPE_GET:
         if (!strcmp(str, XML_NS_DISCO_INFO))
-          xml_iq_disco_info_write(auth, doc);
-          break;
-        return (Shotgun_Event_Iq*)1;
+          xml_iq_disco_info_write(auth, iq);
+        break;
       case SHOTGUN_IQ_TYPE_SET:
+        if (!strcmp(str, XML_NS_ROSTER))
+          {
+             const char *from;
+             size_t len;
+
+             /* only the server may push roster changes */
+             from = iq.attribute("from").value();
+             len = eina_stringshare_strlen(auth->user);
+             if (from[0] && (strncmp(from, auth->user, len) || (from[len] != '@') ||
+                             strcmp(from + len + 1, auth->from)))
+               {
+                  ERR("Ignoring roster push from %s", from);
+                  break;
+               }
+             xml_iq_result_write(auth, iq);
+             return xml_iq_roster_read(auth, node, EINA_FALSE);
+          }
       default:
         break;
      }
    return NULL;
 }
 
-char *
-xml_message_write(Shotgun_Auth *auth __UNUSED__, const char *to, const char *msg, Shotgun_Message_Status status, size_t *len)
+/* outgoing messages and presence have a fixed shape, so they are spliced
+ * together from these fragments instead of going through the DOM
+ */
+#define XML_MESSAGE_OPEN "<message to='"
+#define XML_MESSAGE_TYPE "' type='chat' xml:lang='en'>"
+#define XML_CHATSTATE(NAME) "<" NAME " xmlns='" XML_NS_CHATSTATES "'/>"
+#define XML_FRAGMENT(STR) { STR, sizeof(STR) - 1 }
+
+static const struct
+{
+   const char *xml;
+   size_t len;
+} xml_chatstates[] =
+{
+   XML_FRAGMENT(""),
+   XML_FRAGMENT(XML_CHATSTATE("active")),
+   XML_FRAGMENT(XML_CHATSTATE("composing")),
+   XML_FRAGMENT(XML_CHATSTATE("paused")),
+   XML_FRAGMENT(XML_CHATSTATE("inactive")),
+   XML_FRAGMENT(XML_CHATSTATE("gone"))
+};
+
+const char *
+xml_message_write(Shotgun_Auth *auth, const char *to, const char *msg, Shotgun_Message_Status status, size_t *len)
 {
 /*
 C: <message from='juliet@im.example.com/balcony'
@@ -545,41 +955,24 @@ C: <message from='juliet@im.example.com/balcony'
    </message>
 */
 
-   xml_document doc;
-   xml_node node, body;
-   node = doc.append_child("message");
-   node.append_attribute("to").set_value(to);
-   node.append_attribute("type").set_value("chat");
-   node.append_attribute("xml:lang").set_value("en");
+   Eina_Strbuf *buf;
 
+   buf = xml_buf_get(auth);
+   XML_APPEND_LITERAL(buf, XML_MESSAGE_OPEN);
+   xml_escape_append(buf, to);
+   XML_APPEND_LITERAL(buf, XML_MESSAGE_TYPE);
    if (msg)
      {
-        body = node.append_child("body");
-        body.append_child(node_pcdata).set_value(msg);
-     }
-   switch (status)
-     {
-      case SHOTGUN_MESSAGE_STATUS_ACTIVE:
-        node = node.append_child("active");
-        break;
-      case SHOTGUN_MESSAGE_STATUS_COMPOSING:
-        node = node.append_child("composing");
-        break;
-      case SHOTGUN_MESSAGE_STATUS_PAUSED:
-        node = node.append_child("paused");
-        break;
-      case SHOTGUN_MESSAGE_STATUS_INACTIVE:
-        node = node.append_child("inactive");
-        break;
-      case SHOTGUN_MESSAGE_STATUS_GONE:
-        node = node.append_child("gone");
-        break;
-      default:
-        return xmlnode_to_buf(doc, len, EINA_FALSE);
+        XML_APPEND_LITERAL(buf, "<body>");
+        xml_escape_append(buf, msg);
+        XML_APPEND_LITERAL(buf, "</body>");
      }
-   node.append_attribute("xmlns").set_value(XML_NS_CHATSTATES);
+   if ((status > SHOTGUN_MESSAGE_STATUS_NONE) && (status <= SHOTGUN_MESSAGE_STATUS_GONE))
+     eina_strbuf_append_length(buf, xml_chatstates[status].xml, xml_chatstates[status].len);
+   XML_APPEND_LITERAL(buf, "</message>");
 
-   return xmlnode_to_buf(doc, len, EINA_FALSE);
+   *len = eina_strbuf_length_get(buf);
+   return eina_strbuf_string_get(buf);
 }
 
 Shotgun_Event_Message *
@@ -594,7 +987,8 @@ E: <message from='romeo@example.net/orchard'
      <body>Neither, fair saint, if either thee dislike.</body>
    </message>
 */
-   xml_document doc;
+   xml_arena_scope scope(auth);
+   xml_document &doc = scope.ctx->doc;
    xml_node node;
    xml_attribute attr;
    xml_parse_result res;
@@ -644,7 +1038,11 @@ E: <message from='romeo@example.net/orchard'
    return ret;
 }
 
-char *
+#define XML_PRESENCE_OPEN "<presence xml:lang='en'>"
+#define XML_PRESENCE_UNAVAILABLE "<presence xml:lang='en' type='unavailable'>"
+#define XML_PRESENCE_SHOW(SHOW) "<show>" SHOW "</show>"
+
+const char *
 xml_presence_write(Shotgun_Auth *auth, size_t *len)
 {
 /*
@@ -655,38 +1053,44 @@ xml_presence_write(Shotgun_Auth *auth, size_t *len)
   <priority>1</priority>
 </presence>
 */
-   xml_document doc;
-   xml_node node, show;
-   char buf[64];
-
-   node = doc.append_child("presence");
-   node.append_attribute("xml:lang").set_value("en");
-   if (auth->status != SHOTGUN_USER_STATUS_NORMAL)
-     show = node.append_child("show").append_child(node_pcdata);
-   else if (!auth->status)
-     node.append_attribute("type").set_value("unavailable");
+   Eina_Strbuf *buf;
+   char prio[32];
+   int plen;
+
+   buf = xml_buf_get(auth);
    switch (auth->status)
      {
+      case SHOTGUN_USER_STATUS_NONE:
+        XML_APPEND_LITERAL(buf, XML_PRESENCE_UNAVAILABLE);
+        break;
       case SHOTGUN_USER_STATUS_AWAY:
-        show.set_value("away");
+        XML_APPEND_LITERAL(buf, XML_PRESENCE_OPEN XML_PRESENCE_SHOW("away"));
         break;
       case SHOTGUN_USER_STATUS_CHAT:
-        show.set_value("chat");
+        XML_APPEND_LITERAL(buf, XML_PRESENCE_OPEN XML_PRESENCE_SHOW("chat"));
         break;
       case SHOTGUN_USER_STATUS_DND:
-        show.set_value("dnd");
+        XML_APPEND_LITERAL(buf, XML_PRESENCE_OPEN XML_PRESENCE_SHOW("dnd"));
         break;
       case SHOTGUN_USER_STATUS_XA:
-        show.set_value("xa");
+        XML_APPEND_LITERAL(buf, XML_PRESENCE_OPEN XML_PRESENCE_SHOW("xa"));
         break;
       default:
+        XML_APPEND_LITERAL(buf, XML_PRESENCE_OPEN);
         break;
      }
-   if (auth->desc) node.append_child("status").append_child(node_pcdata).set_value(auth->desc);
-   snprintf(buf, sizeof(buf), "%i", auth->priority);
-   node.append_child("priority").append_child(node_pcdata).set_value(buf);
+   if (auth->desc)
+     {
+        XML_APPEND_LITERAL(buf, "<status>");
+        xml_escape_append(buf, auth->desc);
+        XML_APPEND_LITERAL(buf, "</status>");
+     }
+   plen = snprintf(prio, sizeof(prio), "<priority>%i</priority>", auth->priority);
+   eina_strbuf_append_length(buf, prio, plen);
+   XML_APPEND_LITERAL(buf, "</presence>");
 
-   return xmlnode_to_buf(doc, len, EINA_FALSE);
+   *len = eina_strbuf_length_get(buf);
+   return eina_strbuf_string_get(buf);
 }
 
 Shotgun_Event_Presence *
@@ -699,7 +1103,8 @@ xml_presence_read(Shotgun_Auth *auth, char *xml, size_t size)
   <status>gone home</status>
 </presence>
 */
-   xml_document doc;
+   xml_arena_scope scope(auth);
+   xml_document &doc = scope.ctx->doc;
    xml_node node;
    xml_attribute attr;
    xml_parse_result res;
@@ -4,26 +4,35 @@
 #include "shotgun_private.h"
 
 #define XML_STARTTLS "<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>"
+#define XML_SM_ENABLE "<enable xmlns='urn:xmpp:sm:3' resume='true'/>"
+#define XML_SM_REQUEST "<r xmlns='urn:xmpp:sm:3'/>"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-char *xml_stream_init_create(Shotgun_Auth *auth, const char *lang, size_t *len);
+void xml_init(void);
+
+const char *xml_stream_init_create(Shotgun_Auth *auth, const char *lang, size_t *len);
 Eina_Bool xml_stream_init_read(Shotgun_Auth *auth, char *xml, size_t size);
 Eina_Bool xml_starttls_read(char *xml, size_t size);
-char *xml_sasl_write(const char *sasl, size_t *len);
-Eina_Bool xml_sasl_read(const unsigned char *xml, size_t size);
+const char *xml_sasl_write(Shotgun_Auth *auth, const char *mech, const void *data, size_t size, size_t *len);
+const char *xml_sasl_response_write(Shotgun_Auth *auth, const void *data, size_t size, size_t *len);
+Shotgun_Sasl_Type xml_sasl_read(Shotgun_Auth *auth, char *xml, size_t size, char **data, size_t *data_size);
+
+Shotgun_Sm_Type xml_sm_read(Shotgun_Auth *auth, char *xml, size_t size, unsigned int *h);
+const char *xml_sm_ack_write(Shotgun_Auth *auth, size_t *len);
+const char *xml_sm_resume_write(Shotgun_Auth *auth, size_t *len);
 
-char *xml_iq_write_preset(Shotgun_Auth *auth, Shotgun_Iq_Preset p, size_t *len);
-char *xml_iq_write_get_vcard(const char *to, size_t *len);
-Shotgun_Event_Iq *xml_iq_read(Shotgun_Auth *auth, char *xml, size_t size);
+const char *xml_iq_write_preset(Shotgun_Auth *auth, Shotgun_Iq_Preset p, const char *id, size_t *len);
+const char *xml_iq_write_get_vcard(Shotgun_Auth *auth, const char *to, const char *id, size_t *len);
+Shotgun_Event_Iq *xml_iq_read(Shotgun_Auth *auth, char *xml, size_t size, Shotgun_Iq_Reply *reply);
 
-char *xml_message_write(Shotgun_Auth *auth, const char *to, const char *msg, Shotgun_Message_Status status, size_t *len);
+const char *xml_message_write(Shotgun_Auth *auth, const char *to, const char *msg, Shotgun_Message_Status status, size_t *len);
 Shotgun_Event_Message *xml_message_read(Shotgun_Auth *auth, char *xml, size_t size);
 
 
-char *xml_presence_write(Shotgun_Auth *auth, size_t *len);
+const char *xml_presence_write(Shotgun_Auth *auth, size_t *len);
 Shotgun_Event_Presence *xml_presence_read(Shotgun_Auth *auth, char *xml, size_t size);
 
 #ifdef __cplusplus